@@ -12,16 +12,107 @@
  *****************************************************************************/
 
 #include "ctcp.h"
-#include "ctcp_linked_list.h"
+#include "ctcp_ack.h"
+#include "ctcp_cc.h"
+#include "ctcp_queue.h"
 #include "ctcp_sys.h"
 #include "ctcp_utils.h"
 #include "stdio.h"
 
-#define FIN_SENT 1UL
-#define FIN_RECEIVED 1UL << 1
-#define EOF_FLAG 1UL << 2
+#define FIN_SENT (1UL)
+#define FIN_RECEIVED (1UL << 1)
+#define EOF_FLAG (1UL << 2)
 #define DESTROY_FLAG ((1UL << 3) - 1)
 
+/** Maximum number of retransmissions of a segment before giving up. */
+#define MAX_RETRANSMITS 5
+
+/** Number of duplicate ACKs that trigger a fast retransmit. */
+#define DUPACK_THRESHOLD 3
+
+/** Loss recoveries a grown RACK reordering window lasts for (RFC 8985). */
+#define RACK_REO_PERSIST 16
+
+/** Bounds on the retransmission timeout, in ms. */
+#define MIN_RTO 10
+#define MAX_RTO 60000
+
+/** Longest a corked segment smaller than a full one is held back, in ms. */
+#define CORK_TIMEOUT 200
+
+/**
+ * Pacing rate as a percentage of what the congestion window sends in an RTT.
+ * Slow start paces at twice that, so the window can still double every RTT.
+ */
+#define PACE_SS_RATIO 200
+#define PACE_CA_RATIO 120
+
+/** Most segments pacing lets out back to back. */
+#define PACE_BURST 2
+
+/**
+ * Segments a connection of weight 1 may send per scheduling round. A
+ * connection of weight n gets n times as many.
+ */
+#define SCHED_QUANTUM 4
+
+/** How long the receive window stays grown without data arriving, in ms. */
+#define WINDOW_IDLE_TIMEOUT 1000
+
+/** Most SACK blocks sent in one segment. Four fill up the option space. */
+#define MAX_SACK_BLOCKS 4
+
+/** Sequence number comparisons that survive wraparound. */
+#define SEQ_LT(a, b) ((int32_t) ((a) - (b)) < 0)
+#define SEQ_LEQ(a, b) ((int32_t) ((a) - (b)) <= 0)
+
+/** Length of a timestamp option with the two NOPs that align it. */
+#define TS_OPT_SIZE (TCPOLEN_TIMESTAMP + 2)
+
+/**
+ * A segment in flight. The data itself stays in the send ring; a segment is
+ * only a range of sequence numbers with its own retransmission state, so any
+ * number of them can be in flight at once. Lost segments next to each other
+ * may be merged when they are sent again.
+ *
+ * Segments in flight are kept by value in a ring, in sequence number order.
+ * Each one starts where the one before it ends, so the ring can be searched
+ * by sequence number.
+ */
+typedef struct {
+  long last_sent_time;      /* When this segment was last sent, in ms */
+  int retransmit_count;     /* Number of times it has been retransmitted */
+  int recovery;             /* Loss recovery it was last resent in */
+  uint32_t xmit_order;      /* Place of its latest transmission among all of
+                               the connection's transmissions */
+  long sent_time_us;        /* When it was last sent, in us */
+  uint64_t delivered;       /* The connection's delivered, delivered_time
+                               and first_sent_time when it was last sent */
+  long delivered_time;
+  long first_sent_time;
+  bool app_limited;         /* Whether the sender was application-limited
+                               when it was last sent */
+  bool sacked;              /* Whether the receiver has SACKed it */
+  bool lost;                /* Whether it is waiting to be resent */
+  bool probed;              /* Whether a tail loss probe resent it. Its
+                               last_sent_time is still the original's */
+  uint32_t seqno;           /* First sequence number, in host order */
+  uint32_t seq_len;         /* Sequence space taken up (data + FIN) */
+} tx_segment_t;
+
+/**
+ * A run of received bytes. Overlapping data is trimmed off on arrival, so the
+ * runs held by a connection never overlap each other.
+ */
+typedef struct {
+  queue_link_t link;        /* Place in the reassembly or output buffer */
+  uint32_t seqno;           /* Sequence number of the first byte held */
+  uint16_t data_len;        /* Number of data bytes held */
+  uint16_t offset;          /* Where those bytes start in segment->data */
+  bool fin;                 /* Whether a FIN follows the data */
+  ctcp_segment_t *segment;  /* The received segment holding the data */
+} rx_segment_t;
+
 /**
  * Connection state.
  *
@@ -33,27 +124,147 @@
 struct ctcp_state {
   struct ctcp_state *next;  /* Next in linked list */
   struct ctcp_state **prev; /* Prev in linked list */
+  struct ctcp_state *ready_next;
+                            /* Next in the list of connections with data
+                               waiting for their turn to be sent */
+  struct ctcp_state **ready_prev;
+                            /* Prev in that list, NULL if not on it */
+  int64_t deficit;          /* Bytes the connection may still send in the
+                               current scheduling round */
 
   conn_t *conn;             /* Connection object -- needed in order to figure
                                out destination when sending */
-  linked_list_t *output_buffer;
-                               /* Linked list of segments sent to this connection.
-                               It may be useful to have multiple linked lists
-                               for unacknowledged segments, segments that
-                               haven't been sent, etc. Lab 1 uses the
-                               stop-and-wait protocol and therefore does not
-                               necessarily need a linked list. You may remove
-                               this if this is the case for you */
-
-  /* FIXME: Add other needed fields. */
+  ctcp_pool_t *pool;        /* The connection's pool, which received segments
+                               are freed back to */
+  queue_t output_buffer;    /* rx_segment_t's received in order and waiting
+                               to be outputted */
+  queue_t reassembly_buffer;
+                            /* rx_segment_t's received ahead of ackno, in
+                               seqno order */
+
   ctcp_config_t cfg;
-  linked_list_t *send_buffer;
-  linked_list_t *unacked_buffer;
-  linked_list_t *ackno_list;
-  uint32_t seqno;
-  uint32_t ackno;
-  int retransmitted_times;
-  long last_sent_time;
+  char *send_ring;          /* Input from snd_una up to seqno, indexed by
+                               sequence number modulo the ring size */
+  uint32_t ring_size;       /* Size of send_ring, a power of two */
+  bool input_held;          /* Whether input is held while the ring is
+                               full */
+  ring_t unacked_buffer;    /* tx_segment_t's in flight, in seqno order */
+  uint32_t seqno;           /* Next sequence number to assign to input */
+  uint32_t snd_una;         /* Oldest unacknowledged sequence number */
+  uint32_t snd_nxt;         /* Next sequence number to send for the first
+                               time */
+  long cork_start;          /* When data smaller than a segment was first
+                               held back by SEND_CORK, 0 if none is */
+  int64_t pace_tokens;      /* Bytes pacing lets out right now. Negative
+                               while the last segment is being paid off */
+  long pace_last;           /* When pace_tokens was last topped up, in us */
+  uint32_t snd_wnd;         /* Window the other side last advertised */
+  bool persist;             /* Whether probing a zero window */
+  int persist_backoff;      /* Number of window probes sent so far */
+  long persist_deadline;    /* When the next window probe is due, in ms */
+  uint32_t ackno;           /* Next sequence number expected from the other
+                               side */
+  ctcp_ack_t ack;           /* When to acknowledge received data */
+  uint32_t rcv_adv;         /* Right edge of the window last advertised */
+  uint32_t rcv_wnd;         /* Receive window, grown by autotuning between
+                               cfg.recv_window and cfg.max_recv_window */
+  uint32_t rcv_copied;      /* Data output during the current RTT */
+  long rcv_copied_start;    /* When the current RTT started, in ms */
+  uint32_t rcv_rtt_seq;     /* Sequence number that ends the current receiver
+                               RTT sample */
+  long rcv_rtt_start;       /* When that sample started, in ms, 0 if none */
+  long rcv_rtt;             /* Receiver's estimate of the RTT, in ms, 0 if
+                               none yet */
+  long rcv_last;            /* When in-order data last arrived, in ms */
+  uint32_t bytes_in_flight; /* Sequence space queued on unacked_buffer */
+  uint32_t sacked_bytes;    /* Part of bytes_in_flight the receiver has
+                               SACKed */
+  uint32_t output_bytes;    /* Data bytes queued on output_buffer */
+  uint32_t reassembly_bytes;/* Data bytes queued on reassembly_buffer */
+  uint32_t sack_recent;     /* Sequence number of the latest out-of-order
+                               arrival, reported first in SACK options */
+  bool dsack_pending;       /* Whether a duplicate segment is waiting to be
+                               reported */
+  uint32_t dsack_left;      /* Start of the duplicate, reported first in the
+                               next SACK option (RFC 2883) */
+  uint32_t dsack_right;     /* Sequence number just past the duplicate */
+  uint32_t last_ack_sent;   /* Acknowledgement number last sent */
+  bool ts_recent_valid;     /* Whether a timestamp has been received yet */
+  uint32_t ts_recent;       /* Timestamp to echo back (RFC 7323) */
+  bool rtt_measured;        /* Whether an RTT sample has been taken yet */
+  long srtt;                /* Smoothed round-trip time, in 1/8 ms */
+  long rttvar;              /* Round-trip time variation, in 1/4 ms */
+  long rto;                 /* Retransmission timeout, in ms */
+  long min_rto;             /* Lower bound on rto, in ms */
+  ctcp_cc_t cc;             /* Congestion control state */
+  bool rto_recovery;        /* Whether recovering from a timeout */
+  bool fast_recovery;       /* Whether in fast recovery (RFC 6582) */
+  uint32_t recover;         /* Sequence number that ends the recovery */
+  int recovery;             /* Number of fast recoveries so far */
+  int dupacks;              /* Duplicate ACKs received in a row */
+  uint32_t inflation;       /* Extra window during fast recovery, one
+                               segment per duplicate ACK */
+  uint32_t xmit_count;      /* Segments transmitted so far */
+  uint64_t delivered;       /* Bytes ACKed or SACKed so far */
+  long delivered_time;      /* When delivered last grew, in us */
+  long first_sent_time;     /* When the segment that starts the current
+                               delivery rate interval was sent, in us */
+  uint64_t app_limited;     /* What delivered has to pass to end the current
+                               application-limited stretch, 0 if none */
+  bool rs_valid;            /* Whether the ACK being handled delivered
+                               anything. The rs_ fields then describe the
+                               most recently sent segment it delivered */
+  uint32_t rs_order;
+  uint64_t rs_prior_delivered;
+  long rs_prior_time;
+  long rs_send_elapsed;
+  long rs_rtt;
+  bool rs_app_limited;
+  uint32_t rs_acked;        /* Bytes the ACK delivered */
+  long min_rtt;             /* Lowest RTT sample so far, in ms */
+  long min_rtt_us;          /* Lowest RTT of a segment sent only once, in us,
+                               0 until there is one */
+  bool rack_valid;          /* Whether any segment is known delivered yet */
+  uint32_t rack_order;      /* Transmission number of the most recently sent
+                               segment known to be delivered (RACK) */
+  long rack_rtt;            /* RTT of that segment, in ms */
+  bool rack_reordering;     /* Whether segments were seen to arrive out of
+                               order */
+  int rack_reo_mult;        /* Reordering window, in quarters of min_rtt */
+  int rack_reo_persist;     /* Fast recoveries left before it shrinks back */
+  uint32_t rack_dsack_seq;  /* What a D-SACK must come with an ACK past to
+                               grow the reordering window again */
+  long rack_deadline;       /* When segments not yet deemed lost should be
+                               checked again, in ms, 0 if none */
+  long tlp_deadline;        /* When a tail loss probe is due, in ms, 0 if
+                               none is */
+  bool tlp_active;          /* Whether a probe is out with its outcome still
+                               unknown */
+  uint32_t tlp_high_seq;    /* snd_nxt when that probe was sent */
+  long tlp_time_us;         /* When it was sent, in us */
+  bool undo_valid;          /* Whether the last loss episode may still turn
+                               out to be spurious */
+  bool undo_timeout;        /* Whether it started with a timeout */
+  ctcp_cc_t undo_cc;        /* Congestion state from before it */
+  uint32_t undo_marker;     /* snd_una when it started */
+  long undo_ts;             /* When it started, in ms */
+  bool undo_eifel;          /* Whether the first ACK past undo_marker has
+                               yet to be checked against undo_ts */
+  int undo_retrans;         /* Retransmissions in it not yet reported as
+                               duplicates by D-SACK */
+  bool undo_dsack;          /* Whether any D-SACK arrived for it */
+
+  /* Loss recovery statistics, reported when the connection closes. */
+  struct {
+    uint32_t retransmits;   /* Segments sent again */
+    uint32_t tail_probes;   /* Of those, tail loss probes */
+    uint32_t timeouts;      /* Retransmission timeouts */
+    uint32_t fast_recoveries;
+                            /* Fast recoveries started */
+    uint32_t spurious_timeouts;
+                            /* Timeouts undone as spurious */
+    uint32_t spurious_fast; /* Fast recoveries undone as spurious */
+  } stats;
   uint32_t destroy_flag;
 };
 
@@ -64,8 +275,55 @@ struct ctcp_state {
  */
 static ctcp_state_t *state_list;
 
-/* FIXME: Feel free to add as many helper functions as needed. Don't repeat
-          code! Helper functions make the code clearer and cleaner. */
+/**
+ * Connections with new data waiting to be sent, in the order ctcp_schedule()
+ * serves them, and where the next one to join goes.
+ */
+static ctcp_state_t *ready_list;
+static ctcp_state_t **ready_tail = &ready_list;
+
+/**
+ * Puts a connection on the list of those waiting to send new data, unless it
+ * is on it already.
+ *
+ * state: The connection state.
+ * front: Whether to serve it before the others rather than after them.
+ */
+void schedule_send(ctcp_state_t *state, bool front) {
+  if (state->ready_prev != NULL)
+    return;
+  if (front) {
+    state->ready_next = ready_list;
+    state->ready_prev = &ready_list;
+    if (ready_list)
+      ready_list->ready_prev = &state->ready_next;
+    else
+      ready_tail = &state->ready_next;
+    ready_list = state;
+  }
+  else {
+    state->ready_next = NULL;
+    state->ready_prev = ready_tail;
+    *ready_tail = state;
+    ready_tail = &state->ready_next;
+  }
+}
+
+/**
+ * Takes a connection off the list of those waiting to send, if it is on it.
+ *
+ * state: The connection state.
+ */
+void ready_remove(ctcp_state_t *state) {
+  if (state->ready_prev == NULL)
+    return;
+  if (state->ready_next)
+    state->ready_next->ready_prev = state->ready_prev;
+  else
+    ready_tail = state->ready_prev;
+  *state->ready_prev = state->ready_next;
+  state->ready_prev = NULL;
+}
 
 
 ctcp_state_t *ctcp_init(conn_t *conn, ctcp_config_t *cfg) {
@@ -76,214 +334,2002 @@ ctcp_state_t *ctcp_init(conn_t *conn, ctcp_config_t *cfg) {
 
   /* Established a connection. Create a new state and update the linked list
      of connection states. */
-  ctcp_state_t *state = calloc(sizeof(ctcp_state_t), 1);
+  ctcp_state_t *state = arena_alloc(conn_arena(conn), sizeof(ctcp_state_t));
   state->next = state_list;
   state->prev = &state_list;
   if (state_list)
     state_list->prev = &state->next;
   state_list = state;
+  state->ready_next = NULL;
+  state->ready_prev = NULL;
+  state->deficit = 0;
 
   /* Set fields. */
   state->conn = conn;
-  /* FIXME: Do any other initialization here. */ 
+  state->pool = conn_pool(conn);
   memcpy(&(state->cfg), cfg, sizeof(ctcp_config_t));
   state->seqno = 1;
+  state->snd_una = 1;
+  state->snd_nxt = 1;
+  state->cork_start = 0;
+  state->pace_tokens = PACE_BURST * cfg->mss;
+  state->pace_last = current_time_us();
+  state->snd_wnd = cfg->send_window;
+  state->persist = false;
+  state->persist_backoff = 0;
+  state->persist_deadline = 0;
   state->ackno = 1;
-  state->output_buffer = ll_create();
-  state->send_buffer = ll_create();
-  state->unacked_buffer = ll_create();
-  state->ackno_list = ll_create();
-  state->last_sent_time = 0;
-  state->retransmitted_times = 0;
+  state->rcv_adv = 1 + cfg->recv_window;
+  state->rcv_wnd = cfg->recv_window;
+  state->rcv_copied = 0;
+  state->rcv_copied_start = 0;
+  state->rcv_rtt_seq = 0;
+  state->rcv_rtt_start = 0;
+  state->rcv_rtt = 0;
+  state->rcv_last = 0;
+  ack_init(&state->ack, cfg->delayed_ack, cfg->mss);
+  queue_init(&state->output_buffer);
+  queue_init(&state->reassembly_buffer);
+  ring_init(&state->unacked_buffer, conn_arena(conn), sizeof(tx_segment_t),
+            cfg->send_window / cfg->mss + 1);
+
+  /* Room for a window's worth of data in flight plus a window's worth
+     waiting to go out. */
+  state->ring_size = 1;
+  while (state->ring_size < 2 * cfg->send_window)
+    state->ring_size <<= 1;
+  state->send_ring = arena_alloc(conn_arena(conn), state->ring_size);
+  state->bytes_in_flight = 0;
+  state->sacked_bytes = 0;
+  state->output_bytes = 0;
+  state->reassembly_bytes = 0;
+  state->sack_recent = 0;
+  state->dsack_pending = false;
+  state->last_ack_sent = 1;
+  state->ts_recent_valid = false;
+  state->ts_recent = 0;
+  state->rtt_measured = false;
+  state->srtt = 0;
+  state->rttvar = 0;
+  state->rto = cfg->rt_timeout;
+
+  /* The last segment of a burst may have its ACK held back for the delayed-
+     ACK timeout, and the timer only runs every so often on both ends. Don't
+     time out before such an ACK could have arrived. */
+  state->min_rto = cfg->delayed_ack + 2 * cfg->timer;
+  if (state->min_rto < MIN_RTO)
+    state->min_rto = MIN_RTO;
+  cc_init(&state->cc, cfg->cc_algorithm, cfg->mss);
+  state->rto_recovery = false;
+  state->fast_recovery = false;
+  state->recover = 0;
+  state->recovery = 0;
+  state->dupacks = 0;
+  state->inflation = 0;
+  state->xmit_count = 0;
+  state->delivered = 0;
+  state->delivered_time = 0;
+  state->first_sent_time = 0;
+  state->app_limited = 0;
+  state->rs_valid = false;
+  state->rs_acked = 0;
+  state->min_rtt = 0;
+  state->min_rtt_us = 0;
+  state->rack_valid = false;
+  state->rack_order = 0;
+  state->rack_rtt = 0;
+  state->rack_reordering = false;
+  state->rack_reo_mult = 1;
+  state->rack_reo_persist = 0;
+  state->rack_dsack_seq = 1;
+  state->rack_deadline = 0;
+  state->tlp_deadline = 0;
+  state->tlp_active = false;
+  state->tlp_high_seq = 0;
+  state->tlp_time_us = 0;
+  state->undo_valid = false;
+  state->undo_eifel = false;
   state->destroy_flag = 0;
+  free(cfg);
   return state;
 }
-void free_segments_list(linked_list_t *list) {
-  ll_node_t *segment_node = list->head;
-  while(segment_node != NULL) {
-    free(segment_node->object);
-    segment_node = segment_node->next;
+
+/**
+ * Gets the received run a queue link belongs to.
+ *
+ * link: The link, or NULL.
+ * returns: The run, NULL if link is NULL.
+ */
+rx_segment_t *rx_entry(queue_link_t *link) {
+  return link ? queue_entry(link, rx_segment_t, link) : NULL;
+}
+
+/**
+ * Gets a segment in flight.
+ *
+ * state: The connection state.
+ * i: Position of the segment, 0 being the oldest.
+ * returns: The segment. It moves when segments are added or removed.
+ */
+tx_segment_t *unacked_at(ctcp_state_t *state, uint32_t i) {
+  return ring_at(&state->unacked_buffer, i);
+}
+
+/**
+ * Returns the number of segments in flight.
+ */
+uint32_t num_unacked(ctcp_state_t *state) {
+  return ring_length(&state->unacked_buffer);
+}
+
+/**
+ * Finds the segment in flight that holds a sequence number, or else the first
+ * one after it.
+ *
+ * state: The connection state.
+ * seqno: The sequence number, in host order.
+ * returns: Position of the segment, the number of segments if none is at or
+ *          after seqno.
+ */
+uint32_t unacked_find(ctcp_state_t *state, uint32_t seqno) {
+  uint32_t lo = 0;
+  uint32_t hi = num_unacked(state);
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    tx_segment_t *tx = unacked_at(state, mid);
+    if (SEQ_LT(seqno, tx->seqno + tx->seq_len))
+      hi = mid;
+    else
+      lo = mid + 1;
   }
-  ll_destroy(list);
+  return lo;
+}
+
+/**
+ * Frees a received segment, giving its buffer back to the connection's pool.
+ *
+ * state: The connection state.
+ * rx: The segment.
+ */
+void free_rx(ctcp_state_t *state, rx_segment_t *rx) {
+  pool_free(state->pool, rx->segment);
+  pool_free(state->pool, rx);
 }
+
 void ctcp_destroy(ctcp_state_t *state) {
   /* Update linked list. */
-  fprintf(stderr, "destroy called %s\n", "");
   if (state->next)
     state->next->prev = state->prev;
 
   *state->prev = state->next;
+  ready_remove(state);
   conn_remove(state->conn);
 
-  /* FIXME: Do any other cleanup here. */
-  free_segments_list(state->output_buffer);
-  free_segments_list(state->send_buffer);
-  free_segments_list(state->unacked_buffer);
-  free_segments_list(state->ackno_list);
-  free(state);
+  if (state->stats.retransmits > 0)
+    fprintf(stderr, "[INFO] %u retransmissions (%u tail loss probes), "
+            "%u timeouts (%u spurious), %u fast recoveries (%u spurious)\n",
+            state->stats.retransmits, state->stats.tail_probes,
+            state->stats.timeouts, state->stats.spurious_timeouts,
+            state->stats.fast_recoveries, state->stats.spurious_fast);
+
+  /* The state and everything it holds came from the connection's arena, and
+     go along with the connection. */
   end_client();
 }
 
+/**
+ * Copies data out of the send ring.
+ *
+ * state: The connection state.
+ * seqno: Sequence number of the first byte to copy.
+ * buf: Where to copy the data to.
+ * len: Number of bytes to copy.
+ */
+void ring_copy(ctcp_state_t *state, uint32_t seqno, char *buf, uint32_t len) {
+  uint32_t start = seqno & (state->ring_size - 1);
+  uint32_t first = state->ring_size - start;
+  if (first > len)
+    first = len;
+  memcpy(buf, state->send_ring + start, first);
+  memcpy(buf + first, state->send_ring, len - first);
+}
+
+/**
+ * Grows the send ring so it keeps room for two of the other side's windows,
+ * as that window may grow past what it started at.
+ *
+ * state: The connection state.
+ * window: The other side's window, in bytes.
+ */
+void ring_grow(ctcp_state_t *state, uint32_t window) {
+  uint32_t size = state->ring_size;
+  while (size < 2 * window)
+    size <<= 1;
+  if (size == state->ring_size)
+    return;
+
+  /* Copy the buffered input over to where it goes in the larger ring. */
+  uint32_t len = 0;
+  if (SEQ_LT(state->snd_una, state->seqno))
+    len = state->seqno - state->snd_una;
+  char *ring = arena_alloc(conn_arena(state->conn), size);
+  uint32_t start = state->snd_una & (size - 1);
+  uint32_t first = size - start;
+  if (first > len)
+    first = len;
+  ring_copy(state, state->snd_una, ring + start, first);
+  ring_copy(state, state->snd_una + first, ring, len - first);
 
-void ctcp_read(ctcp_state_t *state) {
-  /* FIXME */
-  char input[MAX_SEG_DATA_SIZE];
-  int data_size = conn_input(state->conn, input, MAX_SEG_DATA_SIZE);
-  fprintf(stderr, "read data size = %u", data_size);
-  if (data_size == -1) {
-    state->destroy_flag |= EOF_FLAG;
-    data_size = 0;
-  }
-  uint16_t total_size = sizeof(ctcp_segment_t) + sizeof(char) * data_size;
-  ctcp_segment_t *segment = calloc(total_size, 1);
-  segment->seqno = htonl(state->seqno);
-  segment->len = htons(total_size);
-  segment->window = htons(MAX_SEG_DATA_SIZE);
+  arena_free(conn_arena(state->conn), state->send_ring, state->ring_size);
+  state->send_ring = ring;
+  state->ring_size = size;
+}
+
+/**
+ * Returns the receive window to advertise: the part of the receive buffer not
+ * taken up by data waiting for output. Out-of-order data sits inside the
+ * window, so it does not count against it. To avoid silly window syndrome, a
+ * window too small to be worth filling is advertised as closed (RFC 1122,
+ * section 4.2.3.3). A window already advertised is never taken back.
+ *
+ * state: The connection state.
+ */
+uint32_t recv_window(ctcp_state_t *state) {
+  uint32_t window = 0;
+  if (state->output_bytes < state->rcv_wnd)
+    window = state->rcv_wnd - state->output_bytes;
+
+  uint32_t threshold = state->rcv_wnd / 2;
+  if (threshold > state->cfg.mss)
+    threshold = state->cfg.mss;
+  if (window < threshold)
+    window = 0;
+
+  if (SEQ_LT(state->ackno + window, state->rcv_adv))
+    window = state->rcv_adv - state->ackno;
+  return window;
+}
+
+/**
+ * Stamps the current acknowledgement number, window and checksum on a segment
+ * and sends it.
+ *
+ * state: The connection state.
+ * segment: The segment to send, in network-byte order.
+ */
+void send_with_ack(ctcp_state_t *state, ctcp_segment_t *segment) {
+  segment->ackno = htonl(state->ackno);
+  state->last_ack_sent = state->ackno;
+  segment->flags |= htonl(ACK);
+  /* Round a scaled window up rather than take back part of what was
+     advertised before. */
+  uint8_t shift = state->cfg.rcv_wscale;
+  uint32_t window = (recv_window(state) + (1 << shift) - 1) >> shift;
+  segment->window = htons(window);
+  state->rcv_adv = state->ackno + (window << shift);
   segment->cksum = 0;
-  if (data_size > 0) {
-    memcpy(segment->data, input, data_size);
-  } else if (state->destroy_flag & EOF_FLAG){
-    segment->flags = FIN;
+  segment->cksum = cksum(segment, ntohs(segment->len));
+  conn_send(state->conn, segment, ntohs(segment->len));
+  ack_sent(&state->ack);
+}
+
+/**
+ * Returns how much of what is in flight is still in the network, i.e. has
+ * not been SACKed by the receiver.
+ *
+ * state: The connection state.
+ */
+uint32_t pipe_bytes(ctcp_state_t *state) {
+  return state->bytes_in_flight - state->sacked_bytes;
+}
+
+/**
+ * Writes a timestamp option carrying the current time and the timestamp to
+ * echo back (RFC 7323). Timestamps are in ms.
+ *
+ * state: The connection state.
+ * opts: Where to write the option. Must have room for TS_OPT_SIZE bytes.
+ * returns: Length of the option including padding.
+ */
+uint16_t write_timestamp_option(ctcp_state_t *state, uint8_t *opts) {
+  uint32_t ts_val = htonl(current_time());
+  uint32_t ts_ecr = htonl(state->ts_recent);
+  opts[0] = TCPOPT_NOP;
+  opts[1] = TCPOPT_NOP;
+  opts[2] = TCPOPT_TIMESTAMP;
+  opts[3] = TCPOLEN_TIMESTAMP;
+  memcpy(opts + 4, &ts_val, sizeof(uint32_t));
+  memcpy(opts + 8, &ts_ecr, sizeof(uint32_t));
+  return TS_OPT_SIZE;
+}
+
+/**
+ * Builds a segment covering a range of the stream out of the send ring and
+ * sends it. The FIN goes with the range that ends just past the data.
+ *
+ * state: The connection state.
+ * tx: The range to send.
+ */
+void transmit(ctcp_state_t *state, tx_segment_t *tx) {
+  char buf[sizeof(ctcp_segment_t) + MAX_OPT_SIZE + MAX_UNIX_SEG_DATA_SIZE];
+  ctcp_segment_t *segment = (ctcp_segment_t *) buf;
+  bool fin = (state->destroy_flag & EOF_FLAG) &&
+             tx->seqno + tx->seq_len == state->seqno + 1;
+  uint16_t data_len = tx->seq_len - fin;
+  uint16_t opt_len = 0;
+
+  memset(segment, 0, sizeof(ctcp_segment_t));
+  if (state->cfg.timestamps)
+    opt_len = write_timestamp_option(state, (uint8_t *) segment->data);
+  segment->seqno = htonl(tx->seqno);
+  segment->len = htons(sizeof(ctcp_segment_t) + opt_len + data_len);
+  segment->flags = htonl((fin ? FIN : 0) |
+                         (opt_len / 4) << OPT_WORDS_SHIFT);
+  ring_copy(state, tx->seqno, segment->data + opt_len, data_len);
+
+  /* Snapshot what has been delivered so far, for a delivery rate sample
+     once this is delivered. Sending into an empty network starts a new
+     interval. */
+  long now_us = current_time_us();
+  if (state->bytes_in_flight <= tx->seq_len) {
+    state->first_sent_time = now_us;
+    state->delivered_time = now_us;
   }
-  segment->flags |= ACK;
-  segment->flags = htonl(segment->flags);
-  ll_add (state->send_buffer, segment);
+  tx->xmit_order = ++state->xmit_count;
+  tx->sent_time_us = now_us;
+  tx->delivered = state->delivered;
+  tx->delivered_time = state->delivered_time;
+  tx->first_sent_time = state->first_sent_time;
+  tx->app_limited = state->app_limited != 0;
+  send_with_ack(state, segment);
 }
 
-void ctcp_receive(ctcp_state_t *state, ctcp_segment_t *segment, size_t len) {
-  /* FIXME */
-  fprintf(stderr, "message received  %s with lenth %zu\n", segment->data, strlen(segment->data));
-  if (ntohl(segment->ackno) == state->seqno) {
-      if (state->unacked_buffer->head != NULL) {
-        free(state->unacked_buffer->head->object);
-        ll_remove(state->unacked_buffer, state->unacked_buffer->head);
+/**
+ * Schedules a tail loss probe (RFC 8985, section 7) for two RTTs from now,
+ * plus a timer tick of slack. The ACK for a lone segment in flight may be
+ * delayed, so that is allowed for too. No probe is scheduled during loss
+ * recovery, or while the outcome of the last one is still unknown.
+ *
+ * state: The connection state.
+ * now: The current time, in ms.
+ */
+void tlp_arm(ctcp_state_t *state, long now) {
+  state->tlp_deadline = 0;
+  if (state->bytes_in_flight == 0 || state->fast_recovery ||
+      state->rto_recovery || state->persist || state->tlp_active)
+    return;
+
+  long pto = state->rto;
+  if (state->rtt_measured)
+    pto = 2 * (state->srtt >> 3) + state->cfg.timer;
+  if (state->bytes_in_flight <= state->cfg.mss)
+    pto += state->cfg.delayed_ack;
+  state->tlp_deadline = now + pto;
+}
+
+/**
+ * Decides whether to hold back data too small to fill a segment, following
+ * the connection's send policy.
+ *
+ * state: The connection state.
+ * now: The current time, in ms.
+ * returns: true if the data should wait, false if it should go out now.
+ */
+bool hold_small_segment(ctcp_state_t *state, long now) {
+  switch (state->cfg.send_policy) {
+  case SEND_NAGLE:
+    return state->bytes_in_flight > 0;
+  case SEND_CORK:
+    if (state->cork_start == 0)
+      state->cork_start = now;
+    return now - state->cork_start < CORK_TIMEOUT;
+  default:
+    return false;
+  }
+}
+
+/**
+ * Returns the rate to pace segments out at, in bytes per second: the
+ * congestion window per SRTT, scaled up so pacing does not hold back what the
+ * window allows, unless congestion control sets the rate itself. Either way,
+ * it is capped by cfg.max_pacing_rate.
+ *
+ * state: The connection state.
+ * returns: The rate, 0 if there is no limit.
+ */
+uint64_t pacing_rate(ctcp_state_t *state) {
+  uint64_t rate = 0;
+  uint64_t max_rate = state->cfg.max_pacing_rate;
+
+  /* srtt is in 1/8 ms. */
+  if (cc_paces(&state->cc))
+    rate = cc_pacing_rate(&state->cc);
+  else if (state->rtt_measured && state->srtt > 0) {
+    int ratio = state->cc.cwnd < state->cc.ssthresh ? PACE_SS_RATIO :
+                                                      PACE_CA_RATIO;
+    rate = (uint64_t) cc_cwnd(&state->cc) * 8000 * ratio / 100 / state->srtt;
+  }
+  if (max_rate != 0 && (rate == 0 || rate > max_rate))
+    rate = max_rate;
+  return rate;
+}
+
+/**
+ * Decides whether pacing lets a segment out now. Connections are paced if
+ * --pace asked for it or congestion control needs it. A token bucket fills
+ * at the pacing rate and holds up to PACE_BURST segments. A segment may take
+ * the bucket below empty. The next one then waits until the bucket has
+ * filled back up, and the library is asked to wake the connection then.
+ *
+ * state: The connection state.
+ * len: Sequence space of the segment.
+ * returns: true if the segment may go out now.
+ */
+bool pace_allows(ctcp_state_t *state, uint32_t len) {
+  if (!state->cfg.pacing && !cc_paces(&state->cc))
+    return true;
+  uint64_t rate = pacing_rate(state);
+  if (rate == 0)
+    return true;
+
+  long now = current_time_us();
+  long elapsed = now - state->pace_last;
+  if (elapsed < 0)
+    elapsed = 0;
+  if (elapsed > 1000000)
+    elapsed = 1000000;
+  state->pace_tokens += elapsed * rate / 1000000;
+  if (state->pace_tokens > PACE_BURST * state->cfg.mss)
+    state->pace_tokens = PACE_BURST * state->cfg.mss;
+  state->pace_last = now;
+
+  if (state->pace_tokens > 0) {
+    state->pace_tokens -= len;
+    return true;
+  }
+  conn_wakeup(state->conn,
+              now + 1 - state->pace_tokens * 1000000 / (int64_t) rate);
+  return false;
+}
+
+/**
+ * Cuts segments out of the data waiting in the send ring and sends them for
+ * as long as they fit. Once input has ended, the last bit of data always
+ * goes out, whatever the send policy.
+ *
+ * The other side's window bounds everything in flight, while the congestion
+ * window (inflated during fast recovery) bounds only what is still in the
+ * network. At least one segment is always allowed in flight so a congestion
+ * window smaller than a segment cannot stall the connection. If the other
+ * side's window is closed, the persist timer takes over. With pacing on,
+ * segments go out no faster than the pacing rate. Sending new data pushes
+ * the tail loss probe back. Only ctcp_schedule() calls this, and sending
+ * stops once the connection's deficit for the current round is used up.
+ *
+ * state: The connection state.
+ * returns: true if there is more to send once the connection's turn comes
+ *          around again.
+ */
+bool send_segments(ctcp_state_t *state) {
+  long now = current_time();
+  uint32_t cwnd = cc_cwnd(&state->cc) + state->inflation;
+  bool sent = false;
+  bool out_of_turn = false;
+
+  while (!(state->destroy_flag & FIN_SENT)) {
+    uint32_t seq_len = state->seqno - state->snd_nxt;
+    if (seq_len > state->cfg.mss)
+      seq_len = state->cfg.mss;
+
+    /* All data is out. Hold the FIN back until all of it is acknowledged.
+       Some peers take a FIN that arrives ahead of missing data as the end of
+       the stream. */
+    if (seq_len == 0) {
+      /* Out of data with room to spare. Delivery rates until what is in
+         flight now is delivered tell more about the application than about
+         the network. */
+      if (pipe_bytes(state) < cwnd) {
+        state->app_limited = state->delivered + state->bytes_in_flight;
+        if (state->app_limited == 0)
+          state->app_limited = 1;
       }
-      state->retransmitted_times = 0;
+      if (!(state->destroy_flag & EOF_FLAG) || state->bytes_in_flight > 0)
+        break;
+      seq_len = 1;
+    }
+    else if (seq_len < state->cfg.mss &&
+             !(state->destroy_flag & EOF_FLAG) &&
+             hold_small_segment(state, now)) {
+      break;
+    }
+
+    /* Probe a closed window from the timer until it opens again. */
+    if (state->snd_wnd == 0) {
+      if (state->bytes_in_flight == 0 && !state->persist) {
+        state->persist = true;
+        state->persist_backoff = 0;
+        state->persist_deadline = now + state->rto;
+      }
+      break;
+    }
+
+    /* A window smaller than a segment takes what fits once nothing else is
+       in flight. */
+    if (state->bytes_in_flight == 0 && seq_len > state->snd_wnd)
+      seq_len = state->snd_wnd;
+    if (state->bytes_in_flight > 0 &&
+        (state->bytes_in_flight + seq_len > state->snd_wnd ||
+         pipe_bytes(state) + seq_len > cwnd))
+      break;
+    if (seq_len > state->deficit) {
+      out_of_turn = true;
+      break;
+    }
+    if (!pace_allows(state, seq_len))
+      break;
+
+    tx_segment_t *tx = ring_push(&state->unacked_buffer);
+    tx->seqno = state->snd_nxt;
+    tx->seq_len = seq_len;
+    tx->last_sent_time = now;
+    tx->recovery = state->recovery;
+    state->snd_nxt += seq_len;
+    state->bytes_in_flight += seq_len;
+    if (state->snd_nxt == state->seqno + 1)
+      state->destroy_flag |= FIN_SENT;
+    if (state->snd_nxt == state->seqno)
+      state->cork_start = 0;
+    transmit(state, tx);
+    state->deficit -= seq_len;
+    sent = true;
+  }
+  if (sent)
+    tlp_arm(state, now);
+  return out_of_turn;
+}
+
+bool ctcp_schedule() {
+  ctcp_state_t *state;
+  int n = 0;
+
+  /* One round: every connection waiting now gets its quantum. Those with
+     more to send go to the back and keep what is left of their deficit. An
+     idle one forfeits it, so it cannot save up for a burst later. */
+  for (state = ready_list; state != NULL; state = state->ready_next)
+    n++;
+  for (; n > 0; n--) {
+    state = ready_list;
+    ready_remove(state);
+    state->deficit += (int64_t) SCHED_QUANTUM * state->cfg.weight *
+                      state->cfg.mss;
+    if (send_segments(state))
+      schedule_send(state, false);
+    else
+      state->deficit = 0;
+  }
+  return ready_list != NULL;
+}
+
+/**
+ * Sends a window probe if one is due: the next byte of data, so the other
+ * side answers with its current window (RFC 1122, section 4.2.2.17). The
+ * time between probes doubles up to MAX_RTO. Probes are kept up for as long
+ * as the window stays closed; they never time the connection out.
+ *
+ * state: The connection state.
+ */
+void send_window_probe(ctcp_state_t *state) {
+  long now = current_time();
+  if (!state->persist || now < state->persist_deadline)
+    return;
+
+  if (num_unacked(state) == 0) {
+    tx_segment_t *tx = ring_push(&state->unacked_buffer);
+    tx->seqno = state->snd_nxt;
+    tx->seq_len = 1;
+    tx->recovery = state->recovery;
+    state->snd_nxt++;
+    state->bytes_in_flight++;
+    if (state->snd_nxt == state->seqno + 1)
+      state->destroy_flag |= FIN_SENT;
+  }
+
+  tx_segment_t *tx = unacked_at(state, 0);
+  tx->last_sent_time = now;
+  transmit(state, tx);
+
+  long timeout = state->rto << state->persist_backoff;
+  if (timeout < MAX_RTO)
+    state->persist_backoff++;
+  else
+    timeout = MAX_RTO;
+  state->persist_deadline = now + timeout;
+}
+
+void ctcp_read(ctcp_state_t *state) {
+  int data_size;
+  bool idle = state->snd_nxt == state->seqno;
+
+  /* Already sent everything there is to send. */
+  if (state->destroy_flag & EOF_FLAG)
+    return;
+
+  /* Read straight into the send ring for as long as it has room, so large
+     inputs are not slurped into memory all at once. Segments are cut out of
+     it when sent, so small reads share segments whenever they can. */
+  while (state->seqno - state->snd_una < state->ring_size) {
+    uint32_t start = state->seqno & (state->ring_size - 1);
+    uint32_t room = state->ring_size - (state->seqno - state->snd_una);
+    if (room > state->ring_size - start)
+      room = state->ring_size - start;
+
+    data_size = conn_input(state->conn, state->send_ring + start, room);
+    if (data_size == -1) {
+      state->destroy_flag |= EOF_FLAG;
+      break;
+    }
+    if (data_size == 0)
+      break;
+    state->seqno += data_size;
+  }
+
+  /* Input left waiting while the ring is full would have ctcp_read() called
+     again right away, over and over. Hold it until ACKs make room (see
+     handle_ack()). */
+  if (!state->input_held &&
+      state->seqno - state->snd_una == state->ring_size) {
+    state->input_held = true;
+    conn_hold_input(state->conn, true);
   }
+
+  /* Send as soon as it is this connection's turn rather than waiting for
+     the timer. A connection that had sent all its data is likely an
+     interactive one, so it goes first. It only gets its quantum that way;
+     whatever is left waits its turn like everyone else's. */
+  schedule_send(state, idle);
+}
+
+/**
+ * Feeds a round-trip time sample into the smoothed estimates and recomputes
+ * the retransmission timeout from them (RFC 6298).
+ *
+ * state: The connection state.
+ * rtt: The sample, in ms.
+ */
+void rtt_sample(ctcp_state_t *state, long rtt) {
+  if (!state->rtt_measured || rtt < state->min_rtt)
+    state->min_rtt = rtt;
+  if (!state->rtt_measured) {
+    state->srtt = rtt << 3;
+    state->rttvar = rtt << 1;
+    state->rtt_measured = true;
+  }
+  else {
+    long delta = rtt - (state->srtt >> 3);
+    state->srtt += delta;
+    if (delta < 0)
+      delta = -delta;
+    state->rttvar += delta - (state->rttvar >> 2);
+  }
+
+  state->rto = (state->srtt >> 3) + (state->rttvar > 1 ? state->rttvar : 1);
+  if (state->rto < state->min_rto)
+    state->rto = state->min_rto;
+  if (state->rto > MAX_RTO)
+    state->rto = MAX_RTO;
+}
+
+/**
+ * Returns how long a segment may stay unacknowledged before it is sent
+ * again. The timeout doubles with every retransmission of the segment.
+ *
+ * state: The connection state.
+ * tx: The in-flight segment.
+ */
+long segment_rto(ctcp_state_t *state, tx_segment_t *tx) {
+  long rto = state->rto << tx->retransmit_count;
+  return rto < MAX_RTO ? rto : MAX_RTO;
+}
+
+/**
+ * Remembers the congestion state at the start of a loss episode, so it can be
+ * put back if the episode turns out to be spurious. A timeout during fast
+ * recovery, or another one during timeout recovery, belongs to the episode
+ * already under way. Call this before congestion control reacts.
+ *
+ * state: The connection state.
+ * timeout: Whether the episode starts with a timeout.
+ */
+void undo_start(ctcp_state_t *state, bool timeout) {
+  if (state->fast_recovery || state->rto_recovery)
+    return;
+
+  state->undo_valid = true;
+  state->undo_timeout = timeout;
+  state->undo_cc = state->cc;
+  state->undo_marker = state->snd_una;
+  state->undo_ts = current_time();
+  state->undo_eifel = state->cfg.timestamps;
+  state->undo_retrans = 0;
+  state->undo_dsack = false;
+}
+
+/**
+ * Undoes a spurious loss episode: congestion control puts back what it changed
+ * in response, unless the window has since grown past that, and the
+ * retransmission timeout goes back too. Segments still waiting to be resent
+ * are left to the original transmission.
+ *
+ * state: The connection state.
+ */
+void undo_recovery(ctcp_state_t *state) {
+  uint32_t i;
+
+  if (state->undo_timeout)
+    state->stats.spurious_timeouts++;
+  else
+    state->stats.spurious_fast++;
+
+  cc_undo(&state->cc, &state->undo_cc);
+
+  for (i = 0; i < num_unacked(state); i++) {
+    tx_segment_t *tx = unacked_at(state, i);
+    tx->lost = false;
+    tx->retransmit_count = 0;
+  }
+  state->rto_recovery = false;
+  state->fast_recovery = false;
+  state->dupacks = 0;
+  state->inflation = 0;
+  state->undo_valid = false;
+  state->undo_eifel = false;
+}
+
+/**
+ * Checks whether the last loss episode was spurious, i.e. nothing was lost
+ * and the retransmissions were not needed, and undoes it if so. There are
+ * two ways to tell. The first ACK for the data at the start of the episode
+ * echoes a timestamp from before the episode, so it was sent for the
+ * original transmission (Eifel, RFC 3522). Or the receiver reported every
+ * retransmission as a duplicate with D-SACK (RFC 3708).
+ *
+ * state: The connection state.
+ * ackno: Acknowledgement number received, in host order.
+ * ts_ecr: Timestamp echoed by the segment, NULL if it carried none.
+ */
+void check_spurious(ctcp_state_t *state, uint32_t ackno, uint32_t *ts_ecr) {
+  bool spurious = state->undo_dsack && state->undo_retrans == 0;
+
+  if (state->undo_eifel && ts_ecr != NULL &&
+      SEQ_LT(state->undo_marker, ackno)) {
+    spurious |= SEQ_LT(*ts_ecr, (uint32_t) state->undo_ts);
+    state->undo_eifel = false;
+  }
+  if (spurious)
+    undo_recovery(state);
+}
+
+/**
+ * Sends an in-flight segment again. Lost segments right behind it are merged
+ * into it for as long as the result still fits in one segment, so a run of
+ * small lost segments goes out as a single one.
+ *
+ * state: The connection state.
+ * i: Position of the segment to resend. Segments merged into it are
+ *    removed, so the one after it is then at i + 1.
+ * now: The current time, in ms.
+ * returns: Sequence space sent.
+ */
+uint32_t retransmit(ctcp_state_t *state, uint32_t i, long now) {
+  tx_segment_t *tx = unacked_at(state, i);
+  uint32_t merged = 0;
+
+  while (i + 1 + merged < num_unacked(state)) {
+    tx_segment_t *cur = unacked_at(state, i + 1 + merged);
+    if (!cur->lost || cur->sacked ||
+        tx->seq_len + cur->seq_len > state->cfg.mss)
+      break;
+    tx->seq_len += cur->seq_len;
+    if (cur->retransmit_count > tx->retransmit_count)
+      tx->retransmit_count = cur->retransmit_count;
+    tx->probed |= cur->probed;
+    merged++;
+  }
+  if (merged > 0)
+    ring_remove(&state->unacked_buffer, i + 1, merged);
+
+  tx->lost = false;
+  tx->last_sent_time = now;
+  tx->retransmit_count++;
+  tx->recovery = state->recovery;
+  state->stats.retransmits++;
+  if (state->undo_valid && (state->fast_recovery || state->rto_recovery))
+    state->undo_retrans++;
+  transmit(state, tx);
+  return tx->seq_len;
+}
+
+/**
+ * Retransmits in-flight segments whose own timer has expired, oldest first,
+ * sending no more than a congestion window's worth at once. Segments left
+ * over go out on a later call.
+ *
+ * SACKed segments are skipped, and so is everything while probing a closed
+ * window.
+ *
+ * The first timeout in a loss episode, or a retransmission timing out again,
+ * is reported to congestion control. The episode lasts until everything that
+ * was in flight at the time is acknowledged.
+ *
+ * state: The connection state.
+ * returns: -1 if a segment ran out of retransmissions, 0 otherwise.
+ */
+int retransmit_segments(ctcp_state_t *state) {
+  uint32_t i;
+  long now = current_time();
+  bool reduced = false;
+  uint32_t sent = 0;
+
+  /* A window probe is resent by the persist timer instead. */
+  if (state->persist)
+    return 0;
+
+  for (i = 0; i < num_unacked(state); i++) {
+    tx_segment_t *tx = unacked_at(state, i);
+    if (now - tx->last_sent_time < segment_rto(state, tx))
+      continue;
+
+    /* The receiver already holds SACKed segments. If the oldest one times
+       out anyway, the receiver must have dropped it, so send it again. */
+    if (tx->sacked && i > 0)
+      continue;
+
+    if (tx->retransmit_count == MAX_RETRANSMITS)
+      return -1;
+    if (!reduced && (!state->rto_recovery || tx->retransmit_count > 0)) {
+      undo_start(state, true);
+      state->stats.timeouts++;
+      cc_on_timeout(&state->cc, state->bytes_in_flight);
+      state->rto_recovery = true;
+      state->fast_recovery = false;
+      state->recover = state->snd_nxt;
+      state->dupacks = 0;
+      state->inflation = 0;
+      state->tlp_deadline = 0;
+      state->tlp_active = false;
+      reduced = true;
+    }
+    tx->lost = true;
+  }
+
+  for (i = 0; i < num_unacked(state); i++) {
+    tx_segment_t *tx = unacked_at(state, i);
+    if (!tx->lost)
+      continue;
+    if (sent > 0 && sent + tx->seq_len > cc_cwnd(&state->cc))
+      break;
+    sent += retransmit(state, i, now);
+  }
+  return 0;
+}
+
+/**
+ * Resends the oldest unacknowledged segment right away.
+ *
+ * state: The connection state.
+ */
+void retransmit_first(ctcp_state_t *state) {
+  if (num_unacked(state) == 0)
+    return;
+
+  tx_segment_t *tx = unacked_at(state, 0);
+  if (tx->retransmit_count == MAX_RETRANSMITS)
+    return;
+  retransmit(state, 0, current_time());
+}
+
+/**
+ * Retransmits what the receiver is missing, going by its SACK blocks: the
+ * segments below the highest SACKed one that are neither SACKed nor already
+ * resent during this recovery (RFC 6675), and any that RACK deemed lost.
+ * Lost segments not yet resent are left out of the pipe. Sending stops once
+ * the pipe fills the congestion window, but at least one hole always goes
+ * out.
+ *
+ * state: The connection state.
+ */
+void retransmit_holes(ctcp_state_t *state) {
+  uint32_t i;
+  uint32_t high = 0;
+  uint32_t lost = 0;
+  bool sent = false;
+  long now = current_time();
+
+  /* Without any SACK information, the oldest segment is the only hole. */
+  if (num_unacked(state) == 0)
+    return;
+  high = unacked_at(state, 0)->seqno + 1;
+  for (i = 0; i < num_unacked(state); i++) {
+    tx_segment_t *tx = unacked_at(state, i);
+    if (tx->sacked)
+      high = tx->seqno;
+  }
+
+  for (i = 0; i < num_unacked(state); i++) {
+    tx_segment_t *tx = unacked_at(state, i);
+    if (!SEQ_LT(tx->seqno, high))
+      break;
+    if (!tx->sacked && tx->recovery != state->recovery)
+      tx->lost = true;
+  }
+  for (i = 0; i < num_unacked(state); i++) {
+    tx_segment_t *tx = unacked_at(state, i);
+    if (tx->lost && !tx->sacked)
+      lost += tx->seq_len;
+  }
+
+  uint32_t pipe = pipe_bytes(state) - lost;
+  for (i = 0; i < num_unacked(state); i++) {
+    tx_segment_t *tx = unacked_at(state, i);
+    if (!tx->lost || tx->sacked || tx->retransmit_count == MAX_RETRANSMITS)
+      continue;
+    if (sent && pipe + tx->seq_len > cc_cwnd(&state->cc))
+      break;
+
+    pipe += retransmit(state, i, now);
+    sent = true;
+  }
+}
+
+/**
+ * Sends a tail loss probe if one is due: the last segment in flight goes out
+ * again. Losing the end of a burst brings no duplicate ACKs, so without the
+ * probe only the retransmission timer would notice. The ACK for the probe
+ * shows what the receiver is missing, and RACK takes it from there.
+ *
+ * state: The connection state.
+ */
+void send_tail_probe(ctcp_state_t *state) {
+  long now = current_time();
+  if (state->tlp_deadline == 0 || now < state->tlp_deadline)
+    return;
+  state->tlp_deadline = 0;
+
+  if (num_unacked(state) == 0 || state->fast_recovery || state->rto_recovery ||
+      state->persist)
+    return;
+  tx_segment_t *tx = unacked_at(state, num_unacked(state) - 1);
+  if (tx->sacked || tx->retransmit_count == MAX_RETRANSMITS)
+    return;
+
+  /* The probe leaves the segment's own retransmission timer alone, so a
+     lost probe costs no more than the timeout would have anyway. */
+  state->tlp_active = true;
+  state->tlp_high_seq = state->snd_nxt;
+  state->tlp_time_us = current_time_us();
+  tx->probed = true;
+  state->stats.retransmits++;
+  state->stats.tail_probes++;
+  transmit(state, tx);
+}
+
+/**
+ * Starts fast recovery. Congestion control hears about the loss, and the
+ * recovery lasts until everything in flight now is acknowledged.
+ *
+ * state: The connection state.
+ */
+void enter_fast_recovery(ctcp_state_t *state) {
+  undo_start(state, false);
+  state->stats.fast_recoveries++;
+  cc_on_loss(&state->cc, state->bytes_in_flight);
+  state->fast_recovery = true;
+  state->recover = state->snd_nxt;
+  state->recovery++;
+}
+
+/**
+ * Notes that an in-flight segment reached the receiver, for RACK (RFC 8985).
+ * RACK keeps track of the most recently sent segment known to be delivered,
+ * going by the order of transmissions rather than sequence numbers. A
+ * segment that was never resent but arrives after one sent later shows that
+ * the network reorders segments.
+ *
+ * state: The connection state.
+ * tx: The segment, just ACKed or SACKed.
+ * now: The current time, in ms.
+ */
+void rack_update(ctcp_state_t *state, tx_segment_t *tx, long now) {
+  long rtt = now - tx->last_sent_time;
+
+  /* An ACK for a resent segment quicker than any RTT seen must be for an
+     earlier transmission. */
+  if (tx->retransmit_count > 0 && rtt < state->min_rtt)
+    return;
+
+  if (state->rack_valid && SEQ_LT(tx->xmit_order, state->rack_order)) {
+    if (tx->retransmit_count == 0)
+      state->rack_reordering = true;
+    return;
+  }
+  state->rack_valid = true;
+  state->rack_order = tx->xmit_order;
+  /* A probed segment's RTT would take in the whole probe timeout. */
+  if (!tx->probed)
+    state->rack_rtt = rtt;
+}
+
+/**
+ * Notes that part of an in-flight segment was delivered, for the delivery
+ * rate sample of the ACK being handled. The sample covers the interval from
+ * when the most recently sent segment delivered was sent until now.
+ *
+ * state: The connection state.
+ * tx: The segment, just ACKed or SACKed.
+ * len: How much of it was delivered.
+ */
+void rate_delivered(ctcp_state_t *state, tx_segment_t *tx, uint32_t len) {
+  long now = current_time_us();
+  state->delivered += len;
+  state->delivered_time = now;
+  state->rs_acked += len;
+  if (tx->retransmit_count == 0 && !tx->probed &&
+      (state->min_rtt_us == 0 || now - tx->sent_time_us < state->min_rtt_us))
+    state->min_rtt_us = now - tx->sent_time_us;
+  if (state->rs_valid && SEQ_LT(tx->xmit_order, state->rs_order))
+    return;
+
+  state->rs_valid = true;
+  state->rs_order = tx->xmit_order;
+  state->rs_prior_delivered = tx->delivered;
+  state->rs_prior_time = tx->delivered_time;
+  state->rs_send_elapsed = tx->sent_time_us - tx->first_sent_time;
+  state->rs_rtt = tx->retransmit_count > 0 || tx->probed ? -1 :
+                  now - tx->sent_time_us;
+  state->rs_app_limited = tx->app_limited;
+  state->first_sent_time = tx->sent_time_us;
+}
+
+/**
+ * Finishes the delivery rate sample of an ACK and hands it to congestion
+ * control. The interval is the longer of the send and ACK intervals, so
+ * neither ACK compression nor bursty sending inflates the rate. An interval
+ * shorter than the lowest RTT cannot be trusted.
+ *
+ * state: The connection state.
+ */
+void rate_sample(ctcp_state_t *state) {
+  cc_rate_sample_t rs;
+  if (!state->rs_valid)
+    return;
+  state->rs_valid = false;
+
+  if (state->app_limited != 0 && state->delivered > state->app_limited)
+    state->app_limited = 0;
+
+  long ack_elapsed = state->delivered_time - state->rs_prior_time;
+  rs.delivered = state->delivered - state->rs_prior_delivered;
+  rs.interval = ack_elapsed > state->rs_send_elapsed ?
+                ack_elapsed : state->rs_send_elapsed;
+  if (rs.interval < state->min_rtt * 1000)
+    rs.interval = 0;
+  rs.rtt = state->rs_rtt;
+  rs.prior_delivered = state->rs_prior_delivered;
+  rs.total_delivered = state->delivered;
+  rs.acked = state->rs_acked;
+  rs.in_flight = pipe_bytes(state);
+  rs.app_limited = state->rs_app_limited;
+  state->rs_acked = 0;
+  cc_on_rate_sample(&state->cc, &rs);
+}
+
+/**
+ * Returns how long RACK waits for reordered segments before it deems them
+ * lost, in ms. Until reordering has been seen, it does not wait at all
+ * during loss recovery, or once enough is SACKed for a fast retransmit
+ * anyway. Otherwise it waits a quarter of the lowest RTT, more after
+ * D-SACKs show retransmissions were not needed, but never more than SRTT.
+ *
+ * state: The connection state.
+ */
+long rack_reo_wnd(ctcp_state_t *state) {
+  if (!state->rack_reordering &&
+      (state->fast_recovery || state->rto_recovery ||
+       state->sacked_bytes >= DUPACK_THRESHOLD * state->cfg.mss))
+    return 0;
+
+  long wnd = state->rack_reo_mult * state->min_rtt / 4;
+  if (wnd > state->srtt >> 3)
+    wnd = state->srtt >> 3;
+  return wnd;
+}
+
+/**
+ * Marks as lost every segment sent before the most recently sent delivered
+ * one that has had an RTT plus the reordering window to arrive (RACK, RFC
+ * 8985). Segments still within that time set rack_deadline, when to check
+ * again.
+ *
+ * state: The connection state.
+ * now: The current time, in ms.
+ * returns: Whether any segment was newly marked lost.
+ */
+bool rack_detect_loss(ctcp_state_t *state, long now) {
+  uint32_t i;
+  long reo_wnd = rack_reo_wnd(state);
+  long wait = 0;
+  bool lost = false;
+
+  state->rack_deadline = 0;
+  if (!state->rack_valid)
+    return false;
+
+  for (i = 0; i < num_unacked(state); i++) {
+    tx_segment_t *tx = unacked_at(state, i);
+    if (tx->sacked || tx->lost || !SEQ_LT(tx->xmit_order, state->rack_order))
+      continue;
+
+    long remaining = tx->last_sent_time + state->rack_rtt + reo_wnd - now;
+    if (remaining <= 0) {
+      tx->lost = true;
+      lost = true;
+    }
+    else if (wait == 0 || remaining < wait) {
+      wait = remaining;
+    }
+  }
+  if (wait > 0)
+    state->rack_deadline = now + wait;
+  return lost;
+}
+
+/**
+ * Runs RACK loss detection and repairs what it finds, starting fast recovery
+ * if it is not under way yet. During recovery from a timeout, the
+ * retransmission timer resends lost segments instead. RACK needs SACK, since
+ * without it nothing is ever known to arrive out of order.
+ *
+ * state: The connection state.
+ */
+void rack_recover(ctcp_state_t *state) {
+  if (!state->cfg.sack || state->persist ||
+      !rack_detect_loss(state, current_time()) || state->rto_recovery)
+    return;
+
+  if (!state->fast_recovery)
+    enter_fast_recovery(state);
+  retransmit_holes(state);
+}
+
+/**
+ * Takes note of the window the other side advertised. Windows on ACKs older
+ * than the latest one are ignored, since segments may arrive out of order.
+ * Once the window opens again, window probing stops and sending resumes. A
+ * probe the window update does not acknowledge was dropped by the receiver,
+ * so it is resent ahead of any new data.
+ *
+ * state: The connection state.
+ * ackno: Acknowledgement number that came with the window, in host order.
+ * window: The window, in bytes.
+ */
+void update_send_window(ctcp_state_t *state, uint32_t ackno,
+                        uint32_t window) {
+  if (SEQ_LT(ackno, state->snd_una))
+    return;
+  state->snd_wnd = window;
+  if (window > 0 && state->persist) {
+    state->persist = false;
+    if (num_unacked(state) > 0 && SEQ_LEQ(ackno, unacked_at(state, 0)->seqno))
+      retransmit_first(state);
+  }
+  ring_grow(state, window);
+}
+
+/**
+ * Handles a duplicate ACK. The third one in a row is taken as a sign that the
+ * oldest segment was lost: it is retransmitted and fast recovery starts.
+ * While in fast recovery, every duplicate ACK means another segment has left
+ * the network, so the window is inflated by a segment. With SACK, the
+ * scoreboard tracks that instead and the next holes are retransmitted.
+ *
+ * state: The connection state.
+ */
+void handle_dupack(ctcp_state_t *state) {
+  state->dupacks++;
+  if (state->fast_recovery) {
+    if (state->cfg.sack)
+      retransmit_holes(state);
+    else
+      state->inflation += state->cfg.mss;
+    return;
+  }
+
+  /* Losses from before a timeout are already being dealt with. */
+  if (state->dupacks != DUPACK_THRESHOLD || state->rto_recovery)
+    return;
+
+  enter_fast_recovery(state);
+
+  /* With SACK, the pipe already leaves out what has left the network, so
+     there is no need to inflate the window. */
+  if (state->cfg.sack) {
+    retransmit_holes(state);
+    return;
+  }
+  state->inflation = DUPACK_THRESHOLD * state->cfg.mss;
+  retransmit_first(state);
+}
+
+/**
+ * Handles an acknowledgement. A cumulative ACK releases every in-flight
+ * segment it covers, and the part of one it covers only partly, which can
+ * happen once segments have been merged. That data is dropped from the send
+ * ring. A duplicate ACK is passed on to handle_dupack(). Either kind may show
+ * that the last loss episode was spurious.
+ *
+ * As in RFC 5681, an ACK only counts as a duplicate if it leaves the window
+ * unchanged and no window probe is out. Replies to window probes and window
+ * updates say nothing about lost segments.
+ *
+ * state: The connection state.
+ * ackno: Acknowledgement number received, in host order.
+ * pure: Whether the segment carrying it had no data, SYN, FIN or D-SACK.
+ *       Only those count as duplicate ACKs.
+ * old_wnd: The other side's window from before this segment, in bytes.
+ * ts_ecr: Timestamp echoed by the segment, NULL if it carried none.
+ */
+void handle_ack(ctcp_state_t *state, uint32_t ackno, bool pure,
+                uint32_t old_wnd, uint32_t *ts_ecr) {
+  uint32_t i;
+  long now = current_time();
+  long sent_time = -1;
+  bool retransmitted = false;
+  uint32_t acked = 0;
+
+  /* Only grow the congestion window if it is what limits the sender. */
+  bool cwnd_limited = state->bytes_in_flight + state->cfg.mss >
+                      cc_cwnd(&state->cc);
+
+  if (state->undo_valid)
+    check_spurious(state, ackno, ts_ecr);
+
+  if (state->bytes_in_flight > 0 && pure && ackno == state->snd_una) {
+    /* A duplicate ACK at the end of a tail loss probe means both the probe
+       and what it resent arrived, so nothing was lost. */
+    if (state->tlp_active && ackno == state->tlp_high_seq)
+      state->tlp_active = false;
+    else if (state->snd_wnd == old_wnd && !state->persist)
+      handle_dupack(state);
+    return;
+  }
+
+  /* Ignore ACKs for data not sent yet. */
+  if (SEQ_LT(state->snd_nxt, ackno))
+    return;
+
+  /* Count the segments the ACK covers completely, and release them all at
+     once. One covered in part is trimmed to what is left. */
+  for (i = 0; i < num_unacked(state); i++) {
+    tx_segment_t *tx = unacked_at(state, i);
+    if (SEQ_LEQ(ackno, tx->seqno))
+      break;
+
+    uint32_t n = ackno - tx->seqno;
+    if (n > tx->seq_len)
+      n = tx->seq_len;
+    sent_time = tx->last_sent_time;
+    retransmitted |= tx->retransmit_count > 0 || tx->probed;
+    if (!tx->sacked) {
+      rack_update(state, tx, now);
+      rate_delivered(state, tx, n);
+    }
+    acked += n;
+    state->bytes_in_flight -= n;
+    if (tx->sacked)
+      state->sacked_bytes -= n;
+
+    if (n < tx->seq_len) {
+      tx->seqno += n;
+      tx->seq_len -= n;
+      break;
+    }
+  }
+  ring_pop_front(&state->unacked_buffer, i);
+  if (acked > 0)
+    state->snd_una = ackno;
+
+  /* The ring has room for input again. */
+  if (acked > 0 && state->input_held) {
+    state->input_held = false;
+    conn_hold_input(state->conn, false);
+  }
+
+  /* An echoed timestamp times the segment that triggered this ACK, whether it
+     was retransmitted or not (RFC 7323, section 4). Without one, time the
+     newest segment this ACK covers. Karn's rule: an ACK covering a
+     retransmitted segment gives an ambiguous sample, so skip it. */
+  if (ts_ecr != NULL && acked > 0)
+    rtt_sample(state, (uint32_t) now - *ts_ecr);
+  else if (ts_ecr == NULL && sent_time >= 0 && !retransmitted)
+    rtt_sample(state, now - sent_time);
+
+  if (acked == 0)
+    return;
+  state->dupacks = 0;
+
+  /* The ACK that reaches the end of a tail loss probe settles it. If it is
+     for the probe rather than the original transmission, the probe repaired
+     a loss: react to it like to any other. A timestamp echo tells which one
+     it is for. Without one, an ACK sooner than the lowest RTT after the
+     probe must be for the original. */
+  if (state->tlp_active && SEQ_LEQ(state->tlp_high_seq, ackno)) {
+    long probe_age = current_time_us() - state->tlp_time_us;
+    bool repaired = ts_ecr != NULL ?
+                    !SEQ_LT(*ts_ecr, (uint32_t) (state->tlp_time_us / 1000)) :
+                    probe_age >= state->min_rtt_us;
+    state->tlp_active = false;
+    if (repaired && !state->fast_recovery && !state->rto_recovery) {
+      undo_start(state, false);
+      cc_on_loss(&state->cc, state->bytes_in_flight);
+    }
+  }
+  tlp_arm(state, now);
+
+  /* In fast recovery, a partial ACK means the next segment was lost too.
+     Resend it, and take what was acknowledged back out of the inflation. An
+     ACK for everything up to the recovery point ends fast recovery. */
+  if (state->fast_recovery) {
+    if (SEQ_LT(ackno, state->recover) && state->cfg.sack) {
+      retransmit_holes(state);
+    }
+    else if (SEQ_LT(ackno, state->recover)) {
+      state->inflation = state->inflation > acked ?
+                         state->inflation - acked : 0;
+      state->inflation += state->cfg.mss;
+      retransmit_first(state);
+    }
+    else {
+      state->fast_recovery = false;
+      state->inflation = 0;
+      if (state->rack_reo_persist > 0 && --state->rack_reo_persist == 0)
+        state->rack_reo_mult = 1;
+    }
+    return;
+  }
+
+  if (state->rto_recovery && SEQ_LEQ(state->recover, ackno))
+    state->rto_recovery = false;
+  if (cwnd_limited)
+    cc_on_ack(&state->cc, acked, state->srtt >> 3);
+}
+
+/**
+ * Marks the in-flight segments a SACK block covers as SACKed, and tells RACK
+ * and the delivery rate sample they were delivered.
+ *
+ * state: The connection state.
+ * left: First sequence number of the block.
+ * right: Sequence number just past the block.
+ */
+void sack_block(ctcp_state_t *state, uint32_t left, uint32_t right) {
+  uint32_t i;
+  long now = current_time();
+  for (i = unacked_find(state, left); i < num_unacked(state); i++) {
+    tx_segment_t *tx = unacked_at(state, i);
+    if (SEQ_LEQ(right, tx->seqno))
+      break;
+    if (!tx->sacked && SEQ_LEQ(left, tx->seqno) &&
+        SEQ_LEQ(tx->seqno + tx->seq_len, right)) {
+      tx->sacked = true;
+      state->sacked_bytes += tx->seq_len;
+      rack_update(state, tx, now);
+      rate_delivered(state, tx, tx->seq_len);
+    }
+  }
+}
+
+/**
+ * Finds an option among the options of a received segment. Malformed options
+ * are ignored along with everything after them.
+ *
+ * opts: Start of the options.
+ * len: Length of the options, in bytes.
+ * kind: The kind of option to look for.
+ * returns: The option, NULL if there is none.
+ */
+uint8_t *find_option(uint8_t *opts, uint16_t len, uint8_t kind) {
+  uint16_t i = 0;
+  while (i < len && opts[i] != TCPOPT_EOL) {
+    if (opts[i] == TCPOPT_NOP) {
+      i++;
+      continue;
+    }
+    if (i + 1 >= len || opts[i + 1] < 2 || i + opts[i + 1] > len)
+      return NULL;
+    if (opts[i] == kind)
+      return opts + i;
+    i += opts[i + 1];
+  }
+  return NULL;
+}
+
+/**
+ * Acts on the SACK option of a received ACK, if there is one. A first block
+ * below the acknowledgement number, or inside the second block, reports a
+ * duplicate segment instead (D-SACK, RFC 2883). A duplicate of a tail loss
+ * probe means nothing was lost. A duplicate from the current loss episode
+ * means one of its retransmissions was not needed. Either way, RACK allows
+ * for more reordering, at most once per round trip.
+ *
+ * state: The connection state.
+ * opts: Start of the options.
+ * len: Length of the options, in bytes.
+ * ackno: Acknowledgement number of the ACK, in host order.
+ * returns: Whether the ACK reported a duplicate.
+ */
+bool read_options(ctcp_state_t *state, uint8_t *opts, uint16_t len,
+                  uint32_t ackno) {
+  uint8_t *sack = find_option(opts, len, TCPOPT_SACK);
+  if (sack == NULL || !state->cfg.sack || sack[1] < 10)
+    return false;
+
+  uint32_t blocks[MAX_SACK_BLOCKS * 2];
+  int num_blocks = 0;
+  uint16_t j;
+  for (j = 2; j + 8 <= sack[1] && num_blocks < MAX_SACK_BLOCKS; j += 8) {
+    memcpy(&blocks[num_blocks * 2], sack + j, sizeof(uint32_t));
+    memcpy(&blocks[num_blocks * 2 + 1], sack + j + 4, sizeof(uint32_t));
+    blocks[num_blocks * 2] = ntohl(blocks[num_blocks * 2]);
+    blocks[num_blocks * 2 + 1] = ntohl(blocks[num_blocks * 2 + 1]);
+    num_blocks++;
+  }
+
+  bool dsack = SEQ_LEQ(blocks[1], ackno) ||
+               (num_blocks > 1 && SEQ_LEQ(blocks[2], blocks[0]) &&
+                SEQ_LEQ(blocks[1], blocks[3]));
+  if (dsack && state->tlp_active && SEQ_LT(blocks[0], state->tlp_high_seq) &&
+      SEQ_LEQ(state->tlp_high_seq, blocks[1])) {
+    state->tlp_active = false;
+  }
+  else if (dsack && state->undo_valid && state->undo_retrans > 0 &&
+           SEQ_LEQ(state->undo_marker, blocks[0])) {
+    state->undo_retrans--;
+    state->undo_dsack = true;
+  }
+  if (dsack && SEQ_LEQ(state->rack_dsack_seq, ackno)) {
+    state->rack_reo_mult++;
+    state->rack_reo_persist = RACK_REO_PERSIST;
+    state->rack_dsack_seq = state->snd_nxt;
+  }
+
+  int i;
+  for (i = dsack ? 1 : 0; i < num_blocks; i++)
+    sack_block(state, blocks[i * 2], blocks[i * 2 + 1]);
+  return dsack;
+}
+
+/**
+ * Checks the timestamp option of a received segment (RFC 7323). A timestamp
+ * older than the latest one received means the segment is an old duplicate,
+ * e.g. from before the sequence numbers wrapped around (PAWS). Otherwise,
+ * the timestamp is remembered to echo back if the segment starts at or
+ * before the last acknowledgement number sent. That way, a delayed ACK echoes
+ * the earliest segment it covers, so its RTT sample includes the delay.
+ *
+ * state: The connection state.
+ * opts: Start of the options.
+ * len: Length of the options, in bytes.
+ * seqno: Sequence number of the segment, in host order.
+ * ts_ecr: Set to the echoed timestamp, if there is one.
+ * returns: -1 if the segment is an old duplicate, 1 if it has a timestamp,
+ *          0 if it has none.
+ */
+int read_timestamp(ctcp_state_t *state, uint8_t *opts, uint16_t len,
+                   uint32_t seqno, uint32_t *ts_ecr) {
+  uint8_t *ts = find_option(opts, len, TCPOPT_TIMESTAMP);
+  if (ts == NULL || ts[1] != TCPOLEN_TIMESTAMP || !state->cfg.timestamps)
+    return 0;
+
+  uint32_t ts_val;
+  memcpy(&ts_val, ts + 2, sizeof(uint32_t));
+  memcpy(ts_ecr, ts + 6, sizeof(uint32_t));
+  ts_val = ntohl(ts_val);
+  *ts_ecr = ntohl(*ts_ecr);
+
+  if (state->ts_recent_valid && SEQ_LT(ts_val, state->ts_recent))
+    return -1;
+  if (SEQ_LEQ(seqno, state->last_ack_sent)) {
+    state->ts_recent = ts_val;
+    state->ts_recent_valid = true;
+  }
+  return 1;
+}
+
+/**
+ * Finds the block of contiguous data starting at a run in the reassembly
+ * buffer.
+ *
+ * link: Link of the first run in the block.
+ * left: Set to the first sequence number of the block.
+ * right: Set to the sequence number just past the block.
+ * returns: The link of the run that starts the next block, NULL if none.
+ */
+queue_link_t *next_sack_block(queue_link_t *link, uint32_t *left,
+                              uint32_t *right) {
+  rx_segment_t *rx = rx_entry(link);
+  *left = rx->seqno;
+  *right = rx->seqno + rx->data_len + rx->fin;
+  for (link = link->next; link; link = link->next) {
+    rx = rx_entry(link);
+    if (rx->seqno != *right)
+      break;
+    *right += rx->data_len + rx->fin;
+  }
+  return link;
+}
+
+/**
+ * Writes a SACK option listing the blocks held in the reassembly buffer. The
+ * block with the latest arrival goes first, followed by the others in order
+ * (RFC 2018). A duplicate segment received since the last option is reported
+ * ahead of them all, once (D-SACK, RFC 2883).
+ *
+ * state: The connection state.
+ * opts: Where to write the option.
+ * room: Space left for the option, in bytes. Only as many blocks as fit are
+ *       written.
+ * returns: Length of the option including padding, 0 if there is nothing to
+ *          SACK.
+ */
+uint16_t write_sack_option(ctcp_state_t *state, uint8_t *opts, uint16_t room) {
+  uint32_t blocks[MAX_SACK_BLOCKS * 2];
+  uint32_t left, right;
+  int num_blocks = 0;
+  int max_blocks = room < 4 ? 0 : (room - 4) / 8;
+  queue_link_t *link;
+
+  if (max_blocks > MAX_SACK_BLOCKS)
+    max_blocks = MAX_SACK_BLOCKS;
+  if (max_blocks == 0)
+    return 0;
+
+  if (state->dsack_pending) {
+    blocks[0] = state->dsack_left;
+    blocks[1] = state->dsack_right;
+    num_blocks = 1;
+    state->dsack_pending = false;
+  }
+  int first = num_blocks;
+  for (link = queue_front(&state->reassembly_buffer);
+       link && num_blocks < max_blocks; ) {
+    link = next_sack_block(link, &left, &right);
+    if (SEQ_LEQ(left, state->sack_recent) &&
+        SEQ_LT(state->sack_recent, right)) {
+      blocks[num_blocks * 2] = left;
+      blocks[num_blocks * 2 + 1] = right;
+      num_blocks++;
+      break;
+    }
+  }
+  for (link = queue_front(&state->reassembly_buffer);
+       link && num_blocks < max_blocks; ) {
+    link = next_sack_block(link, &left, &right);
+    if (num_blocks > first && left == blocks[first * 2])
+      continue;
+    blocks[num_blocks * 2] = left;
+    blocks[num_blocks * 2 + 1] = right;
+    num_blocks++;
+  }
+  if (num_blocks == 0)
+    return 0;
+
+  /* Two NOPs keep the blocks 32-bit aligned. */
+  int i;
+  opts[0] = TCPOPT_NOP;
+  opts[1] = TCPOPT_NOP;
+  opts[2] = TCPOPT_SACK;
+  opts[3] = 2 + num_blocks * 8;
+  for (i = 0; i < num_blocks * 2; i++) {
+    uint32_t edge = htonl(blocks[i]);
+    memcpy(opts + 4 + i * 4, &edge, sizeof(uint32_t));
+  }
+  return 4 + num_blocks * 8;
+}
+
+/**
+ * Sends a segment with no data that only acknowledges what has been received.
+ * With SACK on, it also reports any out-of-order data held, in whatever
+ * option space the timestamp leaves.
+ *
+ * state: The connection state.
+ */
+void send_pure_ack(ctcp_state_t *state) {
+  char buf[sizeof(ctcp_segment_t) + MAX_OPT_SIZE];
+  ctcp_segment_t *segment = (ctcp_segment_t *) buf;
+  uint8_t *opts = (uint8_t *) segment->data;
+  uint16_t opt_len = 0;
+
+  memset(segment, 0, sizeof(ctcp_segment_t));
+  if (state->cfg.timestamps)
+    opt_len = write_timestamp_option(state, opts);
+  if (state->cfg.sack)
+    opt_len += write_sack_option(state, opts + opt_len,
+                                 MAX_OPT_SIZE - opt_len);
+  segment->seqno = htonl(state->snd_nxt);
+  segment->len = htons(sizeof(ctcp_segment_t) + opt_len);
+  segment->flags = htonl((opt_len / 4) << OPT_WORDS_SHIFT);
+  send_with_ack(state, segment);
+}
+
+/**
+ * Trims the first n sequence numbers off a received run.
+ *
+ * rx: The run to trim. n must be smaller than its data length plus FIN.
+ */
+void trim_front(rx_segment_t *rx, uint32_t n) {
+  rx->seqno += n;
+  rx->offset += n;
+  rx->data_len -= n;
+}
+
+/**
+ * Puts a received run into the reassembly buffer, keeping it sorted by
+ * sequence number. Bytes already held are trimmed off the new run, and runs
+ * the new one completely covers are dropped.
+ *
+ * state: The connection state.
+ * rx: The run to insert. Freed if it turns out to hold nothing new.
+ */
+void reassembly_insert(ctcp_state_t *state, rx_segment_t *rx) {
+  queue_t *queue = &state->reassembly_buffer;
+  queue_link_t *prev = NULL;
+  queue_link_t *link;
+
+  /* Find the last run starting at or before this one. */
+  for (link = queue_front(queue); link; link = link->next) {
+    rx_segment_t *cur = rx_entry(link);
+    if (SEQ_LT(rx->seqno, cur->seqno))
+      break;
+    prev = link;
+  }
+
+  /* Trim off whatever the previous run already holds. */
+  if (prev != NULL) {
+    rx_segment_t *cur = rx_entry(prev);
+    uint32_t cur_end = cur->seqno + cur->data_len + cur->fin;
+    if (SEQ_LT(rx->seqno, cur_end)) {
+      if (SEQ_LEQ(rx->seqno + rx->data_len + rx->fin, cur_end)) {
+        free_rx(state, rx);
+        return;
+      }
+      trim_front(rx, cur_end - rx->seqno);
+    }
+  }
+
+  /* Drop following runs this one covers, and stop short of a partial one. */
+  link = prev ? prev->next : queue_front(queue);
+  while (link != NULL) {
+    rx_segment_t *cur = rx_entry(link);
+    uint32_t rx_end = rx->seqno + rx->data_len + rx->fin;
+    if (SEQ_LEQ(rx_end, cur->seqno))
+      break;
+
+    if (SEQ_LT(rx_end, cur->seqno + cur->data_len + cur->fin)) {
+      rx->data_len = cur->seqno - rx->seqno;
+      rx->fin = false;
+      break;
+    }
+    queue_link_t *next = link->next;
+    state->reassembly_bytes -= cur->data_len;
+    queue_remove(queue, link);
+    free_rx(state, cur);
+    link = next;
+  }
+
+  state->reassembly_bytes += rx->data_len;
+  if (prev != NULL)
+    queue_insert_after(queue, prev, &rx->link);
+  else
+    queue_push_front(queue, &rx->link);
+}
+
+/**
+ * Moves the contiguous run of data at the front of the reassembly buffer over
+ * to the output buffer, advancing the acknowledgement number past it.
+ *
+ * state: The connection state.
+ */
+void reassembly_release(ctcp_state_t *state) {
+  queue_link_t *link;
+  while ((link = queue_front(&state->reassembly_buffer)) != NULL) {
+    rx_segment_t *rx = rx_entry(link);
+    if (rx->seqno != state->ackno)
+      break;
+
+    queue_remove(&state->reassembly_buffer, link);
+    state->reassembly_bytes -= rx->data_len;
+    state->output_bytes += rx->data_len;
+    state->ackno += rx->data_len;
+    if (rx->fin) {
+      state->ackno++;
+      state->destroy_flag |= FIN_RECEIVED;
+    }
+    queue_push_back(&state->output_buffer, &rx->link);
+  }
+}
+
+/**
+ * Takes a receiver-side RTT sample: the time it takes for a full window of
+ * data to arrive, measured from when the window was opened. This is never
+ * less than the RTT, and close to it when the sender fills the window. It
+ * works even when this side sends no data of its own to time (like Linux's
+ * tcp_rcv_rtt_measure()).
+ *
+ * state: The connection state.
+ * now: The current time, in ms.
+ */
+void rcv_rtt_measure(ctcp_state_t *state, long now) {
+  if (state->rcv_rtt_start != 0 &&
+      SEQ_LEQ(state->rcv_rtt_seq, state->ackno)) {
+    long sample = now - state->rcv_rtt_start;
+    if (sample < 1)
+      sample = 1;
+    if (state->rcv_rtt == 0 || sample < state->rcv_rtt)
+      state->rcv_rtt = sample;
+    else
+      state->rcv_rtt += (sample - state->rcv_rtt) / 8;
+    state->rcv_rtt_start = 0;
+  }
+  if (state->rcv_rtt_start == 0) {
+    state->rcv_rtt_seq = state->ackno + state->rcv_wnd;
+    state->rcv_rtt_start = now;
+  }
+}
+
+/**
+ * Receive-window autotuning, after Linux's dynamic right-sizing. Counts the
+ * data output to the application, and once per RTT grows the window to twice
+ * what was output during that RTT, so the sender is never held back by the
+ * window while the application keeps up. The window only grows here, up to
+ * cfg.max_recv_window; it shrinks back once the connection goes idle.
+ *
+ * state: The connection state.
+ * copied: Number of bytes just output.
+ */
+void rcv_space_adjust(ctcp_state_t *state, uint32_t copied) {
+  long now = current_time();
+  state->rcv_copied += copied;
+
+  /* Use the smaller of both RTT estimates. Either may be missing. One that
+     rounds down to 0 ms still counts, as 1 ms like a receiver-side sample. */
+  long rtt = state->rcv_rtt;
+  if (state->rtt_measured && (rtt == 0 || (state->srtt >> 3) < rtt))
+    rtt = state->srtt >> 3 > 0 ? state->srtt >> 3 : 1;
+  if (rtt == 0 || now - state->rcv_copied_start < rtt)
+    return;
+
+  uint32_t window = 2 * state->rcv_copied;
+  window += state->cfg.mss - 1;
+  window -= window % state->cfg.mss;
+  if (window > state->cfg.max_recv_window)
+    window = state->cfg.max_recv_window;
+  if (window > state->rcv_wnd)
+    state->rcv_wnd = window;
+
+  state->rcv_copied = 0;
+  state->rcv_copied_start = now;
+}
+
+/**
+ * Handles the data and FIN of a received segment: buffers it, ACKs it as the
+ * delayed-ACK policy says and outputs what is now in order.
+ *
+ * state: The connection state.
+ * segment: The segment. Kept for its data or freed.
+ * opt_len: Length of the options at the start of its data.
+ * data_len: Length of the data after the options.
+ */
+void receive_data(ctcp_state_t *state, ctcp_segment_t *segment,
+                  uint16_t opt_len, uint16_t data_len) {
+  rx_segment_t *rx = pool_alloc(state->pool, sizeof(rx_segment_t));
+  memset(rx, 0, sizeof(rx_segment_t));
+  rx->seqno = ntohl(segment->seqno);
+  rx->data_len = data_len;
+  rx->offset = opt_len;
+  rx->fin = (ntohl(segment->flags) & FIN) != 0;
+  rx->segment = segment;
+
+  /* Anything below ackno was already received. Anything past the window
+     cannot be buffered. Either way, ACK what is expected next right away, in
+     case an earlier ACK was lost or this was a window probe. Data up to the
+     edge of the last advertised window is always taken. */
+  uint32_t rx_end = rx->seqno + data_len + rx->fin;
+  uint32_t window_end = state->ackno;
+  if (state->output_bytes < state->rcv_wnd)
+    window_end += state->rcv_wnd - state->output_bytes;
+  if (SEQ_LT(window_end, state->rcv_adv))
+    window_end = state->rcv_adv;
+  bool duplicate = SEQ_LT(rx->seqno, state->ackno);
+  if (duplicate && state->cfg.sack) {
+    state->dsack_pending = true;
+    state->dsack_left = rx->seqno;
+    state->dsack_right = SEQ_LT(rx_end, state->ackno) ? rx_end : state->ackno;
+  }
+  if (SEQ_LEQ(rx_end, state->ackno) ||
+      SEQ_LT(window_end, rx->seqno + data_len)) {
+    send_pure_ack(state);
+    free_rx(state, rx);
+    return;
+  }
+  if (duplicate)
+    trim_front(rx, state->ackno - rx->seqno);
+
+  /* A segment past a gap, or one that fills a gap, is ACKed right away so
+     the sender sees duplicate ACKs promptly (RFC 5681, section 4.2). So is a
+     FIN, which the other side is waiting on to finish. Anything else waits
+     for the delayed-ACK policy. */
+  bool immediate = rx->seqno != state->ackno ||
+                   queue_length(&state->reassembly_buffer) > 0 || rx->fin;
+  if (rx->seqno != state->ackno)
+    state->sack_recent = rx->seqno;
+  uint32_t old_ackno = state->ackno;
+  reassembly_insert(state, rx);
+  reassembly_release(state);
+  if (state->ackno != old_ackno) {
+    long now = current_time();
+    rcv_rtt_measure(state, now);
+    state->rcv_last = now;
+  }
+  if (immediate || ack_on_data(&state->ack, data_len))
+    send_pure_ack(state);
+  ctcp_output(state);
+}
+
+void ctcp_receive(ctcp_state_t *state, ctcp_segment_t *segment, size_t len) {
+  /* Drop truncated segments. */
+  if (len < sizeof(ctcp_segment_t) || len < ntohs(segment->len) ||
+      ntohs(segment->len) < sizeof(ctcp_segment_t)) {
+    pool_free(state->pool, segment);
+    return;
+  }
+
+  /* Drop corrupted segments. */
   uint16_t old_cksum = segment->cksum;
   segment->cksum = 0;
-  if (cksum(segment, ntohs(segment->len)) == old_cksum) {
-    if (strlen(segment->data) > 0 || ntohl(segment->flags) & FIN) {
-      uint32_t * ackno = calloc(sizeof(uint32_t), 1);
-      *ackno = ntohl(segment->seqno) + ntohs(segment->len);      
-      ll_add(state->ackno_list, ackno);
-      fprintf(stderr, "ackno list size %u\n", ll_length(state->ackno_list));
-      if (ntohl(segment->seqno) == state->ackno) {
-        if (strlen(segment->data) > 0 || ntohl(segment->flags) & FIN) {
-          ll_add(state->output_buffer, segment);
-          ctcp_output(state);  //segment free in ctcp_output
-        } else {
-          free(segment);
-        }
-        state->ackno += ntohs(segment->len);
-      } else {
-        free(segment);
-      }
-    } else {
-      free(segment);
-    }    
-  } else {
-    free(segment);
+  if (cksum(segment, ntohs(segment->len)) != old_cksum) {
+    pool_free(state->pool, segment);
+    return;
+  }
+  segment->cksum = old_cksum;
+
+  /* Options come first in the data. Drop segments that claim more options
+     than there is data. */
+  uint32_t flags = ntohl(segment->flags);
+  uint16_t opt_len = ((flags & OPT_WORDS_MASK) >> OPT_WORDS_SHIFT) * 4;
+  if (opt_len > ntohs(segment->len) - sizeof(ctcp_segment_t)) {
+    pool_free(state->pool, segment);
+    return;
   }
+  uint16_t data_len = ntohs(segment->len) - sizeof(ctcp_segment_t) - opt_len;
 
-  if (ntohl(segment->flags) & FIN) {
-    state->destroy_flag |= FIN_RECEIVED;
+  /* Drop old duplicates, but ACK them in case the other side is waiting on
+     an ACK that got lost. */
+  uint8_t *opts = (uint8_t *) segment->data;
+  uint32_t ts_ecr;
+  int ts = read_timestamp(state, opts, opt_len, ntohl(segment->seqno),
+                          &ts_ecr);
+  if (ts < 0) {
+    if (data_len > 0 || (flags & FIN))
+      send_pure_ack(state);
+    pool_free(state->pool, segment);
+    return;
   }
 
+  if (flags & ACK) {
+    bool dsack = read_options(state, opts, opt_len, ntohl(segment->ackno));
+    uint32_t old_wnd = state->snd_wnd;
+    update_send_window(state, ntohl(segment->ackno),
+                       ntohs(segment->window) << state->cfg.snd_wscale);
+    handle_ack(state, ntohl(segment->ackno),
+               data_len == 0 && !(flags & (SYN | FIN)) && !dsack, old_wnd,
+               ts > 0 ? &ts_ecr : NULL);
+    rate_sample(state);
+    rack_recover(state);
+  }
+
+  /* Pure ACKs carry nothing else. */
+  if (data_len > 0 || (flags & FIN))
+    receive_data(state, segment, opt_len, data_len);
+  else
+    pool_free(state->pool, segment);
+
+  /* Send whatever the ACK made room for. The first segment out also carries
+     any delayed ACK. */
+  schedule_send(state, false);
 }
 
 void ctcp_output(ctcp_state_t *state) {
-  /* FIXME */
-  fprintf(stderr, "output called");
-  ll_node_t *node =  state->output_buffer->head;
-  while (node != NULL) {
-    ctcp_segment_t *segment = node->object;
-    int bufspace = conn_bufspace(state->conn);
-    if (strlen(segment->data) > 0) {
-      if (bufspace >= strlen(segment->data)+1){
-        if (conn_output(state->conn, segment->data, strlen(segment->data)) == strlen(segment->data)) {
-          ll_remove(state->output_buffer, node);
-        } else {
-          fprintf(stderr, "output length not equal to segment data length %zu", strlen(segment->data));
-        }
-        if (ntohl(segment->flags) & FIN) {
-	  fprintf(stderr, "eof");
-          conn_output(state->conn, NULL, 0);
-        }
-      }
-    } else if (ntohl(segment->flags) & FIN) {
-	  fprintf(stderr, "eof");
-      conn_output(state->conn, NULL, 0);
+  queue_link_t *link;
+  uint32_t advertised = state->rcv_adv - state->ackno;
+
+  while ((link = queue_front(&state->output_buffer)) != NULL) {
+    rx_segment_t *rx = rx_entry(link);
+
+    /* Output as much as fits. A segment may be larger than the output space,
+       so keep going while there is space left. The library calls this again
+       once output space frees up. */
+    if (rx->data_len > 0) {
+      size_t bufspace = conn_bufspace(state->conn);
+      if (bufspace == 0)
+        break;
+      uint16_t n = bufspace < rx->data_len ? bufspace : rx->data_len;
+      if (conn_output(state->conn, rx->segment->data + rx->offset, n) < 0)
+        break;
+      rx->offset += n;
+      rx->data_len -= n;
+      state->output_bytes -= n;
+      rcv_space_adjust(state, n);
+      if (rx->data_len > 0)
+        continue;
     }
-    free(segment);
-    node = node->next;
+    if (rx->fin)
+      conn_output(state->conn, NULL, 0);
+
+    queue_remove(&state->output_buffer, link);
+    free_rx(state, rx);
   }
+
+  /* Let the other side know as soon as a closed window opens up again, so
+     it doesn't have to wait for its next window probe. */
+  if (advertised < state->cfg.mss &&
+      recv_window(state) >= advertised + state->cfg.mss)
+    send_pure_ack(state);
+}
+
+void ctcp_wakeup(ctcp_state_t *state) {
+  /* Pacing held segments back until now. */
+  schedule_send(state, false);
 }
 
 void ctcp_timer() {
-  /* FIXME */  
   ctcp_state_t *state = state_list;
-  while (state != NULL){
-    long cur_time = current_time();
-    ctcp_segment_t *segment_to_send = NULL;
-    if (ll_length(state->unacked_buffer) > 0) {  // check if last transmitted frame timed out
-      if (cur_time - state->last_sent_time > state->cfg.rt_timeout) {  // time out
-        if (state->retransmitted_times == 5) {
-          fprintf(stderr, "retransmitted times = 5");
-          ctcp_destroy(state);
-        } else {
-          segment_to_send = state->unacked_buffer->head->object;
-          segment_to_send->cksum = 0;
-          state->last_sent_time = cur_time;
-          state->retransmitted_times++;
-        }
-      }
-    } else if (ll_length(state->send_buffer) > 0){
-      ll_node_t *seg_node = state->send_buffer->head;
-      segment_to_send = seg_node->object;
-      if (ntohl(segment_to_send->flags) & FIN) {
-        state->destroy_flag |= FIN_SENT;
-      }
-      ll_add(state->unacked_buffer, segment_to_send);
-      ll_remove(state->send_buffer, seg_node);
-      state->seqno += ntohs(segment_to_send->len);
-      state->last_sent_time = cur_time;
-      state->retransmitted_times = 0;
+  ctcp_state_t *next;
+
+  for (; state != NULL; state = next) {
+    next = state->next;
+
+    if (retransmit_segments(state) < 0) {
+      ctcp_destroy(state);
+      continue;
     }
-    ll_node_t *ackNode = ll_front(state->ackno_list);
-    if (segment_to_send != NULL) {  // piggyback
-      if (ackNode != NULL) {
-        uint32_t *ackno = ackNode->object;
-        segment_to_send->ackno = htonl(*ackno);
-        ll_remove(state->ackno_list, ackNode);
-        free(ackno);
-      } else {
-        segment_to_send->ackno = htonl(state->ackno);
-      }
-      segment_to_send->cksum = cksum(segment_to_send, ntohs(segment_to_send->len));
-      conn_send(state->conn, segment_to_send, ntohs(segment_to_send->len));
-    } else if (ackNode != NULL) {
-	uint32_t *ackno = ackNode->object;
-        segment_to_send = calloc(sizeof(ctcp_segment_t), 1);
-        segment_to_send->seqno = htonl(1);
-        segment_to_send->ackno = htonl(*ackno);
-        segment_to_send->window = htons(MAX_SEG_DATA_SIZE);
-        segment_to_send->flags = htonl(ACK);
-        segment_to_send->cksum = 0;
-        segment_to_send->len = htons(sizeof(ctcp_segment_t));
-        segment_to_send->cksum = cksum(segment_to_send, sizeof(ctcp_segment_t));
-        conn_send(state->conn, segment_to_send, sizeof(ctcp_segment_t));
-        //fprintf(stderr, "send ack\n");
-        ll_remove(state->ackno_list, ackNode);
-        free(ackno);
-        //state->seqno += sizeof(ctcp_segment_t);
-        free(segment_to_send);
+
+    send_window_probe(state);
+    send_tail_probe(state);
+    if (state->rack_deadline != 0 && current_time() >= state->rack_deadline)
+      rack_recover(state);
+
+    /* An idle connection gives back the window autotuning grew. Whatever
+       was already advertised stays, and is shrunk away as data arrives. */
+    if (state->rcv_wnd > state->cfg.recv_window &&
+        current_time() - state->rcv_last > WINDOW_IDLE_TIMEOUT) {
+      state->rcv_wnd = state->cfg.recv_window;
+      state->rcv_rtt_start = 0;
     }
 
-    if (state->destroy_flag & DESTROY_FLAG) {
-      //fprintf(stderr, "destroy_flag");
+    /* Corked data may have waited long enough. */
+    if (state->cork_start != 0)
+      schedule_send(state, false);
+
+    /* Nothing to piggyback the ACK on before its timeout. Send it alone. */
+    if (ack_due(&state->ack, current_time()))
+      send_pure_ack(state);
+
+    /* Both sides are done and everything has been delivered. */
+    if ((state->destroy_flag & DESTROY_FLAG) == DESTROY_FLAG &&
+        num_unacked(state) == 0 &&
+        queue_length(&state->output_buffer) == 0 &&
+        queue_length(&state->reassembly_buffer) == 0) {
       ctcp_destroy(state);
     }
-    state = state->next;
   }
 }
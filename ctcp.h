@@ -28,6 +28,15 @@
  */
 #define MAX_SEG_DATA_SIZE 1440
 
+/**
+ * Largest segment data size over a Unix socket, where segments do not have to
+ * fit in an Ethernet frame. A segment must still fit in the 16-bit length
+ * fields along with its IP and TCP headers (40 bytes) and options. The size a
+ * connection actually uses is agreed on in the handshake (see
+ * ctcp_config_t.mss) and may be anything up to this.
+ */
+#define MAX_UNIX_SEG_DATA_SIZE (UINT16_MAX - 40 - MAX_OPT_SIZE)
+
 /**
  * cTCP flags.
  *
@@ -38,6 +47,31 @@
 #define ACK ntohl(TH_ACK)
 #define FIN ntohl(TH_FIN)
 
+/**
+ * cTCP options.
+ *
+ * A segment may start its data with TCP options, e.g. SACK blocks. Their
+ * length in 32-bit words is kept in these bits of the flags (in HOST order),
+ * the same way the TCP data offset covers options in a TCP header. The data
+ * proper follows the options.
+ */
+#define OPT_WORDS_SHIFT 16
+#define OPT_WORDS_MASK (0xfU << OPT_WORDS_SHIFT)
+#define MAX_OPT_SIZE 40
+
+
+/**
+ * Send policies. They decide what happens to data that does not fill a whole
+ * segment:
+ *    SEND_NODELAY  Send it right away.
+ *    SEND_NAGLE    Hold it while earlier data is unacknowledged (RFC 896).
+ *    SEND_CORK     Hold it until a full segment builds up, input ends or it
+ *                  has waited too long.
+ */
+#define SEND_NODELAY 0
+#define SEND_NAGLE 1
+#define SEND_CORK 2
+
 
 /**
  * cTCP configuration struct.
@@ -45,14 +79,35 @@
  * Use these values to adjust your cTCP implementation accordingly.
  */
 typedef struct {
-  uint16_t recv_window;    /* Receive window size (in multiples of
+  uint32_t recv_window;    /* Receive window size (in multiples of
                               MAX_SEG_DATA_SIZE) of THIS host. For Lab 1 this
                               value will be 1 * MAX_SEG_DATA_SIZE */
-  uint16_t send_window;    /* Send window size (a.k.a. receive window size of
+  uint32_t send_window;    /* Send window size (a.k.a. receive window size of
                               the OTHER host). For Lab 1 this value
                               will be 1 * MAX_SEG_DATA_SIZE */
+  uint32_t max_recv_window;/* Largest receive window autotuning may grow to.
+                              Autotuning is off if this is recv_window */
+  uint16_t mss;            /* Largest segment data either host sends: the
+                              smaller of both hosts' MSS options */
+  uint8_t snd_wscale;      /* Shift to apply to windows from the OTHER host,
+                              0 unless both hosts agreed on window scaling */
+  uint8_t rcv_wscale;      /* Shift to apply to windows THIS host sends */
   int timer;               /* How often ctcp_timer() is called, in ms */
   int rt_timeout;          /* Retransmission timeout, in ms */
+  int cc_algorithm;        /* Congestion control algorithm (one of the CC_*
+                              constants in ctcp_cc.h) */
+  bool sack;               /* Whether to send and use SACK options */
+  bool timestamps;         /* Whether both hosts agreed on timestamp options
+                              (RFC 7323) */
+  int delayed_ack;         /* How long an ACK for in-order data may be
+                              delayed, in ms */
+  int send_policy;         /* What to do with data smaller than a segment
+                              (one of the SEND_* constants) */
+  bool pacing;             /* Whether to pace segments out */
+  uint32_t max_pacing_rate;/* Cap on the pacing rate, in bytes per second,
+                              0 if none */
+  int weight;              /* Share of the host's transmit opportunities
+                              the connection gets, relative to the others */
 } ctcp_config_t;
 
 /**
@@ -164,6 +219,27 @@ void ctcp_receive(ctcp_state_t *state, ctcp_segment_t *segment, size_t len);
  */
 void ctcp_output(ctcp_state_t *state);
 
+/**
+ * Called once the time asked for with conn_wakeup() has come. Use this to
+ * send segments that were held back until then.
+ *
+ * state: Associated connection state.
+ */
+void ctcp_wakeup(ctcp_state_t *state);
+
+/**
+ * Called by the library on every pass through its event loop, after the
+ * events of that pass are handled. Gives connections with new data to send
+ * their turn, by deficit round robin: each round, a connection may send up to
+ * a quantum in proportion to its weight, plus whatever it did not get to use
+ * of the last one. A busy connection thus cannot starve the others.
+ *
+ * returns: true if some connection still has data waiting for its turn, so
+ *          the library should come back right away rather than wait for
+ *          events.
+ */
+bool ctcp_schedule();
+
 /**
  * Called periodically at specified rate (see the timer field in the
  * ctcp_config_t struct).
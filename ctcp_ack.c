@@ -0,0 +1,40 @@
+#include "ctcp_ack.h"
+#include "ctcp_utils.h"
+
+void ack_init(ctcp_ack_t *ack, int timeout, uint32_t mss) {
+  ack->timeout = timeout;
+  ack->mss = mss;
+  ack->unacked = 0;
+  ack->pending = false;
+  ack->deadline = 0;
+  ack->quick = ACK_QUICKACKS;
+}
+
+bool ack_on_data(ctcp_ack_t *ack, uint16_t len) {
+  ack->unacked += len;
+  if (ack->quick > 0) {
+    ack->quick--;
+    return true;
+  }
+  if (ack->unacked >= 2 * ack->mss || ack->timeout <= 0)
+    return true;
+
+  /* The timeout runs from the oldest data not yet ACKed. */
+  if (!ack->pending) {
+    ack->pending = true;
+    ack->deadline = current_time() + ack->timeout;
+  }
+  return false;
+}
+
+void ack_sent(ctcp_ack_t *ack) {
+  ack->unacked = 0;
+  ack->pending = false;
+}
+
+bool ack_due(ctcp_ack_t *ack, long now) {
+  if (!ack->pending || now < ack->deadline)
+    return false;
+  ack->quick = ACK_QUICKACKS;
+  return true;
+}
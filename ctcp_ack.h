@@ -0,0 +1,72 @@
+/******************************************************************************
+ * ctcp_ack.h
+ * ----------
+ * Acknowledgement policy. Decides when the receiver sends an ACK for data it
+ * has received in order: after every second full-sized segment, or once the
+ * delayed-ACK timeout runs out, whichever comes first (RFC 1122, RFC 5681).
+ * Out-of-order data and FINs are ACKed right away by the caller.
+ *
+ * When the timeout does run out, the sender has most likely stopped to wait
+ * for the ACK, e.g. because its window is full. The next few segments are
+ * then ACKed right away (quick-ACK mode, as in Linux). So are the first few
+ * segments of a connection, to get the sender's slow start going.
+ *
+ * Only the amount of data not yet ACKed is tracked. The acknowledgement
+ * number itself is always the connection's current one.
+ *
+ *****************************************************************************/
+
+#ifndef CTCP_ACK_H
+#define CTCP_ACK_H
+
+#include "ctcp_sys.h"
+
+/** Number of segments ACKed right away in quick-ACK mode. */
+#define ACK_QUICKACKS 16
+
+/** Per-connection acknowledgement state. */
+typedef struct {
+  int timeout;              /* Delayed-ACK timeout, in ms */
+  uint32_t mss;             /* Maximum segment size */
+  uint32_t unacked;         /* Data bytes received since the last ACK */
+  bool pending;             /* Whether an ACK is owed */
+  long deadline;            /* When the owed ACK must go out, in ms */
+  int quick;                /* Segments left to ACK right away */
+} ctcp_ack_t;
+
+/**
+ * Sets up acknowledgement state for a new connection.
+ *
+ * ack: The state to set up.
+ * timeout: Delayed-ACK timeout, in ms.
+ * mss: Maximum segment size, in bytes.
+ */
+void ack_init(ctcp_ack_t *ack, int timeout, uint32_t mss);
+
+/**
+ * Records that data arrived in order.
+ *
+ * ack: The acknowledgement state.
+ * len: Number of data bytes received.
+ * returns: true if an ACK should be sent now, false if it can wait.
+ */
+bool ack_on_data(ctcp_ack_t *ack, uint16_t len);
+
+/**
+ * Records that an ACK was sent, either on its own or on a data segment.
+ *
+ * ack: The acknowledgement state.
+ */
+void ack_sent(ctcp_ack_t *ack);
+
+/**
+ * Checks whether an owed ACK has waited long enough. If so, enters quick-ACK
+ * mode.
+ *
+ * ack: The acknowledgement state.
+ * now: The current time, in ms.
+ * returns: true if an ACK should be sent now.
+ */
+bool ack_due(ctcp_ack_t *ack, long now);
+
+#endif /* CTCP_ACK_H */
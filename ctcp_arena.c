@@ -0,0 +1,131 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ctcp_arena.h"
+
+/** Alignment of everything handed out. */
+#define ARENA_ALIGN 16
+#define ALIGN_UP(n) (((n) + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1))
+
+/** A block. Small allocations follow the header. */
+typedef struct arena_block {
+  struct arena_block *next; /* Next block of the arena or on the free list */
+} arena_block_t;
+
+/** A large allocation. The memory follows the header. */
+typedef struct arena_large {
+  struct arena_large *next;
+  struct arena_large *prev;
+} arena_large_t;
+
+#define BLOCK_HDR_SIZE ALIGN_UP(sizeof(arena_block_t))
+#define LARGE_HDR_SIZE ALIGN_UP(sizeof(arena_large_t))
+
+struct ctcp_arena {
+  arena_block_t *blocks;    /* Blocks in use, the current one first */
+  char *next;               /* Free space left in the current block */
+  size_t left;              /* Bytes left there */
+  arena_large_t *large;     /* Large allocations */
+};
+
+/** Blocks of released arenas, waiting to be used again. */
+static arena_block_t *free_blocks = NULL;
+static int num_free_blocks = 0;
+
+/**
+ * Gets a block, from the free list if there is one.
+ */
+static arena_block_t *block_get(void) {
+  arena_block_t *block = free_blocks;
+  if (block != NULL) {
+    free_blocks = block->next;
+    num_free_blocks--;
+  }
+  else {
+    block = malloc(ARENA_BLOCK_SIZE);
+  }
+  block->next = NULL;
+  return block;
+}
+
+/**
+ * Adds a block to an arena and makes it the one allocations come from.
+ */
+static void block_add(ctcp_arena_t *arena, arena_block_t *block) {
+  block->next = arena->blocks;
+  arena->blocks = block;
+  arena->next = (char *) block + BLOCK_HDR_SIZE;
+  arena->left = ARENA_BLOCK_SIZE - BLOCK_HDR_SIZE;
+}
+
+ctcp_arena_t *arena_create(void) {
+  /* The arena lives at the start of its own first block. */
+  arena_block_t *block = block_get();
+  ctcp_arena_t *arena = (ctcp_arena_t *) ((char *) block + BLOCK_HDR_SIZE);
+  arena->blocks = block;
+  arena->next = (char *) arena + ALIGN_UP(sizeof(ctcp_arena_t));
+  arena->left = ARENA_BLOCK_SIZE - BLOCK_HDR_SIZE -
+                ALIGN_UP(sizeof(ctcp_arena_t));
+  arena->large = NULL;
+  return arena;
+}
+
+void arena_destroy(ctcp_arena_t *arena) {
+  arena_large_t *large = arena->large;
+  while (large != NULL) {
+    arena_large_t *next = large->next;
+    free(large);
+    large = next;
+  }
+
+  /* The arena itself goes with its first block, so read it out first. */
+  arena_block_t *block = arena->blocks;
+  while (block != NULL) {
+    arena_block_t *next = block->next;
+    if (num_free_blocks < ARENA_MAX_FREE_BLOCKS) {
+      block->next = free_blocks;
+      free_blocks = block;
+      num_free_blocks++;
+    }
+    else {
+      free(block);
+    }
+    block = next;
+  }
+}
+
+void *arena_alloc(ctcp_arena_t *arena, size_t size) {
+  if (size > ARENA_MAX_SMALL) {
+    arena_large_t *large = calloc(LARGE_HDR_SIZE + size, 1);
+    large->prev = NULL;
+    large->next = arena->large;
+    if (arena->large != NULL)
+      arena->large->prev = large;
+    arena->large = large;
+    return (char *) large + LARGE_HDR_SIZE;
+  }
+
+  size = ALIGN_UP(size);
+  if (size > arena->left)
+    block_add(arena, block_get());
+  void *ptr = arena->next;
+  arena->next += size;
+  arena->left -= size;
+  memset(ptr, 0, size);
+  return ptr;
+}
+
+void arena_free(ctcp_arena_t *arena, void *ptr, size_t size) {
+  if (ptr == NULL || size <= ARENA_MAX_SMALL)
+    return;
+
+  arena_large_t *large = (arena_large_t *) ((char *) ptr - LARGE_HDR_SIZE);
+  if (large->prev != NULL)
+    large->prev->next = large->next;
+  else
+    arena->large = large->next;
+  if (large->next != NULL)
+    large->next->prev = large->prev;
+  free(large);
+}
@@ -0,0 +1,69 @@
+/******************************************************************************
+ * ctcp_arena.h
+ * ------------
+ * Per-connection memory arena. Everything a connection allocates for itself
+ * (its conn_t and state, the send ring, queued segments and output) comes
+ * from its arena, and all of it is released at once when the connection is
+ * freed. Tearing a connection down therefore takes the same time however
+ * much it still had buffered.
+ *
+ * Small allocations are carved out of fixed-size blocks and are only
+ * released along with the arena. Blocks of closed connections go to a
+ * global free list for the next connection to use, so connections coming
+ * and going do not fragment the heap. Large allocations get memory of their
+ * own and can also be freed one at a time.
+ *
+ *****************************************************************************/
+
+#ifndef CTCP_ARENA_H
+#define CTCP_ARENA_H
+
+#include <stddef.h>
+
+/** Size of a block, in bytes. */
+#define ARENA_BLOCK_SIZE 16384
+
+/** Largest allocation carved out of a block. Anything larger is large. */
+#define ARENA_MAX_SMALL (ARENA_BLOCK_SIZE / 4)
+
+/** Most free blocks kept on the global free list. More go back to malloc. */
+#define ARENA_MAX_FREE_BLOCKS 256
+
+/** A connection's arena. */
+typedef struct ctcp_arena ctcp_arena_t;
+
+/**
+ * Creates an empty arena.
+ *
+ * returns: The arena. Release it with arena_destroy().
+ */
+ctcp_arena_t *arena_create(void);
+
+/**
+ * Releases an arena along with everything allocated from it.
+ *
+ * arena: The arena.
+ */
+void arena_destroy(ctcp_arena_t *arena);
+
+/**
+ * Allocates zeroed memory from an arena.
+ *
+ * arena: The arena.
+ * size: Size needed, in bytes.
+ * returns: The memory, aligned for any type.
+ */
+void *arena_alloc(ctcp_arena_t *arena, size_t size);
+
+/**
+ * Frees memory allocated from an arena before the arena itself goes. Only
+ * large allocations are actually freed; small ones stay until the arena is
+ * destroyed.
+ *
+ * arena: The arena.
+ * ptr: The memory, from arena_alloc(). Nothing happens if it is NULL.
+ * size: The size it was allocated with.
+ */
+void arena_free(ctcp_arena_t *arena, void *ptr, size_t size);
+
+#endif /* CTCP_ARENA_H */
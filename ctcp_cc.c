@@ -0,0 +1,422 @@
+#include <math.h>
+
+#include "ctcp_cc.h"
+#include "ctcp_utils.h"
+
+/**
+ * Returns the slow start threshold to use after a loss: half of what was in
+ * flight, but at least two segments.
+ */
+static uint32_t half_flight(ctcp_cc_t *cc, uint32_t in_flight) {
+  uint32_t half = in_flight / 2;
+  return half > 2 * cc->mss ? half : 2 * cc->mss;
+}
+
+/**
+ * Slow start. Grows the window by the number of bytes acknowledged, so
+ * stretch ACKs that cover many segments count in full (RFC 3465).
+ */
+static void slow_start(ctcp_cc_t *cc, uint32_t acked) {
+  cc->cwnd += acked;
+}
+
+/**
+ * Puts the window back to what it was before a spurious loss, unless it has
+ * grown past that since. Returns whether it did.
+ */
+static bool undo_window(ctcp_cc_t *cc, const ctcp_cc_t *prior) {
+  if (cc->cwnd < prior->cwnd) {
+    cc->cwnd = prior->cwnd;
+    cc->ssthresh = prior->ssthresh;
+    cc->acked_bytes = prior->acked_bytes;
+    return true;
+  }
+  if (cc->ssthresh < prior->ssthresh)
+    cc->ssthresh = prior->ssthresh;
+  return false;
+}
+
+
+////////////////////////////////// NEWRENO ////////////////////////////////////
+
+static void newreno_init(ctcp_cc_t *cc) {
+  cc->acked_bytes = 0;
+}
+
+static void newreno_on_ack(ctcp_cc_t *cc, uint32_t acked, long srtt) {
+  if (cc->cwnd < cc->ssthresh) {
+    slow_start(cc, acked);
+    return;
+  }
+
+  /* Congestion avoidance. One segment per window's worth of ACKs. */
+  cc->acked_bytes += acked;
+  if (cc->acked_bytes >= cc->cwnd) {
+    cc->acked_bytes -= cc->cwnd;
+    cc->cwnd += cc->mss;
+  }
+}
+
+static void newreno_on_loss(ctcp_cc_t *cc, uint32_t in_flight) {
+  cc->ssthresh = half_flight(cc, in_flight);
+  cc->cwnd = cc->ssthresh;
+  cc->acked_bytes = 0;
+}
+
+static void newreno_on_timeout(ctcp_cc_t *cc, uint32_t in_flight) {
+  cc->ssthresh = half_flight(cc, in_flight);
+  cc->cwnd = cc->mss;
+  cc->acked_bytes = 0;
+}
+
+static void newreno_undo(ctcp_cc_t *cc, const ctcp_cc_t *prior) {
+  undo_window(cc, prior);
+}
+
+static uint32_t newreno_cwnd(ctcp_cc_t *cc) {
+  return cc->cwnd;
+}
+
+
+/////////////////////////////////// CUBIC /////////////////////////////////////
+
+/** CUBIC constants (RFC 8312). */
+#define CUBIC_C 0.4
+#define CUBIC_BETA 0.7
+
+static void cubic_init(ctcp_cc_t *cc) {
+  cc->cubic.w_max = 0;
+  cc->cubic.k = 0;
+  cc->cubic.origin = 0;
+  cc->cubic.w_est = 0;
+  cc->cubic.epoch_start = 0;
+}
+
+static void cubic_on_ack(ctcp_cc_t *cc, uint32_t acked, long srtt) {
+  if (cc->cwnd < cc->ssthresh) {
+    slow_start(cc, acked);
+    return;
+  }
+
+  long now = current_time();
+  double cwnd = (double) cc->cwnd / cc->mss;
+
+  /* Start of a new congestion avoidance epoch. */
+  if (cc->cubic.epoch_start == 0) {
+    cc->cubic.epoch_start = now;
+    if (cwnd < cc->cubic.w_max) {
+      cc->cubic.k = cbrt((cc->cubic.w_max - cwnd) / CUBIC_C);
+      cc->cubic.origin = cc->cubic.w_max;
+    }
+    else {
+      cc->cubic.k = 0;
+      cc->cubic.origin = cwnd;
+    }
+    cc->cubic.w_est = cwnd;
+  }
+
+  /* Where the cubic function says the window should be one RTT from now. */
+  double t = (now - cc->cubic.epoch_start + srtt) / 1000.0 - cc->cubic.k;
+  double target = cc->cubic.origin + CUBIC_C * t * t * t;
+  double segments = (double) acked / cc->mss;
+  if (target > cwnd)
+    cwnd += (target - cwnd) / cwnd * segments;
+
+  /* TCP-friendly region. Never grow slower than Reno would. */
+  cc->cubic.w_est += 3 * (1 - CUBIC_BETA) / (1 + CUBIC_BETA) * segments / cwnd;
+  if (cc->cubic.w_est > cwnd)
+    cwnd = cc->cubic.w_est;
+
+  cc->cwnd = cwnd * cc->mss;
+}
+
+/**
+ * Multiplicative decrease shared by losses and timeouts. Remembers where the
+ * window was, releasing some of it early if the window is still shrinking
+ * (fast convergence).
+ */
+static void cubic_reduce(ctcp_cc_t *cc) {
+  double cwnd = (double) cc->cwnd / cc->mss;
+  if (cwnd < cc->cubic.w_max)
+    cc->cubic.w_max = cwnd * (1 + CUBIC_BETA) / 2;
+  else
+    cc->cubic.w_max = cwnd;
+
+  cc->cubic.epoch_start = 0;
+  cc->ssthresh = cc->cwnd * CUBIC_BETA;
+  if (cc->ssthresh < 2 * cc->mss)
+    cc->ssthresh = 2 * cc->mss;
+}
+
+static void cubic_on_loss(ctcp_cc_t *cc, uint32_t in_flight) {
+  cubic_reduce(cc);
+  cc->cwnd = cc->ssthresh;
+}
+
+static void cubic_on_timeout(ctcp_cc_t *cc, uint32_t in_flight) {
+  cubic_reduce(cc);
+  cc->cwnd = cc->mss;
+}
+
+/** The curve goes back along with the window it was fitted to. */
+static void cubic_undo(ctcp_cc_t *cc, const ctcp_cc_t *prior) {
+  if (undo_window(cc, prior))
+    cc->cubic = prior->cubic;
+}
+
+static uint32_t cubic_cwnd(ctcp_cc_t *cc) {
+  return cc->cwnd;
+}
+
+
+///////////////////////////////////// BBR /////////////////////////////////////
+
+/** BBR modes. */
+#define BBR_STARTUP 0
+#define BBR_DRAIN 1
+#define BBR_PROBE_BW 2
+#define BBR_PROBE_RTT 3
+
+/**
+ * Gains, in percent. Startup doubles the sending rate every round (2/ln 2),
+ * and drain empties the queue that built up meanwhile.
+ */
+#define BBR_HIGH_GAIN 289
+#define BBR_DRAIN_GAIN 35
+#define BBR_CWND_GAIN 200
+
+/** How long a min RTT estimate lasts before PROBE_RTT checks it, in us. */
+#define BBR_MIN_RTT_WINDOW 10000000
+
+/** How long PROBE_RTT keeps the window down, in us. */
+#define BBR_PROBE_RTT_TIME 200000
+
+/** Smallest window, in segments. */
+#define BBR_MIN_CWND 4
+
+/** Pacing gains PROBE_BW cycles through, one phase per min RTT. */
+#define BBR_CYCLE_LEN 8
+static const int bbr_cycle_gain[BBR_CYCLE_LEN] = {
+  125, 75, 100, 100, 100, 100, 100, 100
+};
+
+/**
+ * Returns the bottleneck bandwidth estimate: the highest delivery rate over
+ * the last BBR_BW_ROUNDS round trips.
+ */
+static uint64_t bbr_max_bw(ctcp_cc_t *cc) {
+  uint64_t bw = 0;
+  int i;
+  for (i = 0; i < BBR_BW_ROUNDS; i++) {
+    if (cc->bbr.bw[i] > bw)
+      bw = cc->bbr.bw[i];
+  }
+  return bw;
+}
+
+/**
+ * Returns the bandwidth-delay product scaled by a gain, in bytes. Until
+ * there is a model, it is the initial window.
+ */
+static uint32_t bbr_bdp(ctcp_cc_t *cc, int gain) {
+  uint64_t bw = bbr_max_bw(cc);
+  if (bw == 0 || cc->bbr.min_rtt == 0)
+    return CC_INIT_CWND * cc->mss;
+  uint64_t bdp = bw * cc->bbr.min_rtt / 1000000 * gain / 100;
+  return bdp < UINT32_MAX ? bdp : UINT32_MAX;
+}
+
+static void bbr_enter_probe_bw(ctcp_cc_t *cc, long now) {
+  cc->bbr.mode = BBR_PROBE_BW;
+  cc->bbr.cwnd_gain = BBR_CWND_GAIN;
+
+  /* Start anywhere but the draining phase. */
+  cc->bbr.cycle = now % BBR_CYCLE_LEN;
+  if (cc->bbr.cycle == 1)
+    cc->bbr.cycle = 2;
+  cc->bbr.pacing_gain = bbr_cycle_gain[cc->bbr.cycle];
+  cc->bbr.cycle_stamp = now;
+}
+
+static void bbr_init(ctcp_cc_t *cc) {
+  cc->bbr.mode = BBR_STARTUP;
+  cc->bbr.pacing_gain = BBR_HIGH_GAIN;
+  cc->bbr.cwnd_gain = BBR_HIGH_GAIN;
+}
+
+/**
+ * Moves PROBE_BW on to the next gain phase once the current one has lasted a
+ * min RTT. Probing for more bandwidth also waits until the extra data is in
+ * flight, and draining stops early once the queue is gone.
+ */
+static void bbr_advance_cycle(ctcp_cc_t *cc, const cc_rate_sample_t *rs,
+                              long now) {
+  int gain = cc->bbr.pacing_gain;
+  bool elapsed = now - cc->bbr.cycle_stamp > cc->bbr.min_rtt;
+
+  if ((gain == 100 && elapsed) ||
+      (gain > 100 && elapsed && rs->in_flight >= bbr_bdp(cc, gain)) ||
+      (gain < 100 && (elapsed || rs->in_flight <= bbr_bdp(cc, 100)))) {
+    cc->bbr.cycle = (cc->bbr.cycle + 1) % BBR_CYCLE_LEN;
+    cc->bbr.pacing_gain = bbr_cycle_gain[cc->bbr.cycle];
+    cc->bbr.cycle_stamp = now;
+  }
+}
+
+static void bbr_on_rate_sample(ctcp_cc_t *cc, const cc_rate_sample_t *rs) {
+  long now = current_time_us();
+  uint32_t min_cwnd = BBR_MIN_CWND * cc->mss;
+
+  /* A round trip ends once a segment sent after it began is delivered. */
+  bool round_start = false;
+  if (rs->prior_delivered >= cc->bbr.round_end) {
+    cc->bbr.round_end = rs->total_delivered;
+    cc->bbr.round++;
+    cc->bbr.bw[cc->bbr.round % BBR_BW_ROUNDS] = 0;
+    round_start = true;
+  }
+
+  /* An application-limited sample only counts if it raises the estimate. */
+  if (rs->interval > 0) {
+    uint64_t rate = rs->delivered * 1000000 / rs->interval;
+    uint64_t *bw = &cc->bbr.bw[cc->bbr.round % BBR_BW_ROUNDS];
+    if ((!rs->app_limited || rate >= bbr_max_bw(cc)) && rate > *bw)
+      *bw = rate;
+  }
+
+  bool rtt_expired = cc->bbr.min_rtt != 0 &&
+                     now - cc->bbr.min_rtt_stamp > BBR_MIN_RTT_WINDOW;
+  if (rs->rtt > 0 && (cc->bbr.min_rtt == 0 || rs->rtt <= cc->bbr.min_rtt ||
+                      rtt_expired)) {
+    cc->bbr.min_rtt = rs->rtt;
+    cc->bbr.min_rtt_stamp = now;
+  }
+
+  /* The pipe is full once bandwidth stops growing by a quarter a round. */
+  if (!cc->bbr.full_pipe && round_start && !rs->app_limited) {
+    uint64_t bw = bbr_max_bw(cc);
+    if (bw >= cc->bbr.full_bw * 5 / 4) {
+      cc->bbr.full_bw = bw;
+      cc->bbr.full_bw_rounds = 0;
+    }
+    else if (++cc->bbr.full_bw_rounds >= 3) {
+      cc->bbr.full_pipe = true;
+    }
+  }
+
+  if (cc->bbr.mode == BBR_STARTUP && cc->bbr.full_pipe) {
+    cc->bbr.mode = BBR_DRAIN;
+    cc->bbr.pacing_gain = BBR_DRAIN_GAIN;
+  }
+  if (cc->bbr.mode == BBR_DRAIN && rs->in_flight <= bbr_bdp(cc, 100))
+    bbr_enter_probe_bw(cc, now);
+  if (cc->bbr.mode == BBR_PROBE_BW)
+    bbr_advance_cycle(cc, rs, now);
+
+  /* Every so often, drain the queue to see the real min RTT. */
+  if (rtt_expired && cc->bbr.mode != BBR_PROBE_RTT) {
+    cc->bbr.mode = BBR_PROBE_RTT;
+    cc->bbr.pacing_gain = 100;
+    cc->bbr.prior_cwnd = cc->cwnd;
+    cc->bbr.probe_rtt_done = 0;
+  }
+  if (cc->bbr.mode == BBR_PROBE_RTT) {
+    if (cc->bbr.probe_rtt_done == 0 && rs->in_flight <= min_cwnd) {
+      cc->bbr.probe_rtt_done = now + BBR_PROBE_RTT_TIME;
+    }
+    else if (cc->bbr.probe_rtt_done != 0 && now >= cc->bbr.probe_rtt_done) {
+      cc->bbr.min_rtt_stamp = now;
+      if (cc->cwnd < cc->bbr.prior_cwnd)
+        cc->cwnd = cc->bbr.prior_cwnd;
+      if (cc->bbr.full_pipe) {
+        bbr_enter_probe_bw(cc, now);
+      }
+      else {
+        cc->bbr.mode = BBR_STARTUP;
+        cc->bbr.pacing_gain = BBR_HIGH_GAIN;
+      }
+    }
+  }
+
+  /* Grow the window by what was delivered, up to the target. Before the
+     pipe is full, never hold it back. */
+  uint32_t target = bbr_bdp(cc, cc->bbr.cwnd_gain) + 3 * cc->mss;
+  if (cc->bbr.mode == BBR_PROBE_RTT)
+    cc->cwnd = min_cwnd;
+  else if (cc->bbr.full_pipe)
+    cc->cwnd = cc->cwnd + rs->acked < target ? cc->cwnd + rs->acked : target;
+  else if (cc->cwnd < target ||
+           rs->total_delivered < CC_INIT_CWND * cc->mss)
+    cc->cwnd += rs->acked;
+  if (cc->cwnd < min_cwnd)
+    cc->cwnd = min_cwnd;
+}
+
+static uint64_t bbr_pacing_rate(ctcp_cc_t *cc) {
+  uint64_t bw = bbr_max_bw(cc);
+
+  /* No bandwidth sample yet. Go by the initial window over the RTT. */
+  if (bw == 0 && cc->bbr.min_rtt != 0)
+    bw = (uint64_t) CC_INIT_CWND * cc->mss * 1000000 / cc->bbr.min_rtt;
+  return bw * cc->bbr.pacing_gain / 100;
+}
+
+/** The model already allows for random losses, so they change nothing. */
+static void bbr_on_ack(ctcp_cc_t *cc, uint32_t acked, long srtt) {
+}
+
+static void bbr_on_loss(ctcp_cc_t *cc, uint32_t in_flight) {
+}
+
+/**
+ * A timeout means the model no longer fits, e.g. the path went away for a
+ * while. Start over from one segment; rate samples grow the window back.
+ */
+static void bbr_on_timeout(ctcp_cc_t *cc, uint32_t in_flight) {
+  cc->cwnd = cc->mss;
+}
+
+/**
+ * Only the window goes back. The model is built from rate samples, and
+ * those taken since are as good as any.
+ */
+static void bbr_undo(ctcp_cc_t *cc, const ctcp_cc_t *prior) {
+  if (cc->cwnd < prior->cwnd)
+    cc->cwnd = prior->cwnd;
+}
+
+static uint32_t bbr_cwnd(ctcp_cc_t *cc) {
+  return cc->cwnd;
+}
+
+
+//////////////////////////////////// SETUP ////////////////////////////////////
+
+/** Available algorithms, indexed by the CC_* constants. */
+static const ctcp_cc_ops_t cc_algorithms[NUM_CC] = {
+  { "newreno", newreno_init, newreno_on_ack, newreno_on_loss,
+    newreno_on_timeout, newreno_undo, newreno_cwnd, NULL, NULL },
+  { "cubic", cubic_init, cubic_on_ack, cubic_on_loss,
+    cubic_on_timeout, cubic_undo, cubic_cwnd, NULL, NULL },
+  { "bbr", bbr_init, bbr_on_ack, bbr_on_loss,
+    bbr_on_timeout, bbr_undo, bbr_cwnd, bbr_on_rate_sample,
+    bbr_pacing_rate },
+};
+
+int cc_lookup(const char *name) {
+  int i;
+  for (i = 0; i < NUM_CC; i++) {
+    if (strcmp(cc_algorithms[i].name, name) == 0)
+      return i;
+  }
+  return -1;
+}
+
+void cc_init(ctcp_cc_t *cc, int algorithm, uint32_t mss) {
+  memset(cc, 0, sizeof(ctcp_cc_t));
+  cc->ops = &cc_algorithms[algorithm];
+  cc->mss = mss;
+  cc->cwnd = CC_INIT_CWND * mss;
+  cc->ssthresh = UINT32_MAX;
+  cc->ops->init(cc);
+}
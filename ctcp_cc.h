@@ -0,0 +1,197 @@
+/******************************************************************************
+ * ctcp_cc.h
+ * ---------
+ * Congestion control. The sender asks the congestion controller how much it
+ * may have in flight and tells it about ACKs, losses and timeouts. Model-based
+ * algorithms also get delivery rate samples and may set the pacing rate. Each
+ * algorithm is a set of hooks; which one a connection uses is picked on the
+ * command line with --cc.
+ *
+ *****************************************************************************/
+
+#ifndef CTCP_CC_H
+#define CTCP_CC_H
+
+#include "ctcp_sys.h"
+
+/** Congestion control algorithms. */
+#define CC_NEWRENO 0
+#define CC_CUBIC 1
+#define CC_BBR 2
+#define NUM_CC 3
+
+/** Initial congestion window, in segments (RFC 6928). */
+#define CC_INIT_CWND 10
+
+/** Round trips BBR's bottleneck bandwidth estimate spans. */
+#define BBR_BW_ROUNDS 10
+
+/** Per-connection congestion control state. */
+typedef struct ctcp_cc ctcp_cc_t;
+
+/**
+ * A delivery rate sample, taken from an ACK that reports data delivered
+ * (draft-cheng-iccrg-delivery-rate-estimation). The rate is delivered over
+ * interval. Times are in microseconds.
+ */
+typedef struct {
+  uint64_t delivered;       /* Bytes delivered over the interval */
+  long interval;            /* Length of the interval, 0 if too short to
+                               trust */
+  long rtt;                 /* RTT of the most recently sent segment that was
+                               delivered, -1 if it was retransmitted */
+  uint64_t prior_delivered; /* Bytes delivered in all when that segment was
+                               sent */
+  uint64_t total_delivered; /* Bytes delivered in all */
+  uint32_t acked;           /* Bytes newly delivered by this ACK */
+  uint32_t in_flight;       /* Bytes still in the network after this ACK */
+  bool app_limited;         /* Whether the sender ran out of data during the
+                               interval, so the rate may be low */
+} cc_rate_sample_t;
+
+/**
+ * A congestion control algorithm. All window sizes are in bytes.
+ */
+typedef struct {
+  const char *name;         /* Name used to select this on the command line */
+
+  /**
+   * Sets up algorithm-specific state. cwnd, ssthresh and mss are already set.
+   */
+  void (*init)(ctcp_cc_t *cc);
+
+  /**
+   * Called when an ACK acknowledges new data.
+   *
+   * acked: Number of bytes newly acknowledged.
+   * srtt: Current smoothed round-trip time in ms, or 0 if not yet measured.
+   */
+  void (*on_ack)(ctcp_cc_t *cc, uint32_t acked, long srtt);
+
+  /**
+   * Called when a loss is detected some other way than by a timeout, e.g. by
+   * duplicate ACKs.
+   *
+   * in_flight: Number of bytes in flight when the loss was detected.
+   */
+  void (*on_loss)(ctcp_cc_t *cc, uint32_t in_flight);
+
+  /**
+   * Called when the retransmission timer expires.
+   *
+   * in_flight: Number of bytes in flight when the timer expired.
+   */
+  void (*on_timeout)(ctcp_cc_t *cc, uint32_t in_flight);
+
+  /**
+   * Called when the last loss or timeout turns out to be spurious. Puts back
+   * what the algorithm changed in response to it.
+   *
+   * prior: The state from before the loss or timeout.
+   */
+  void (*undo)(ctcp_cc_t *cc, const ctcp_cc_t *prior);
+
+  /**
+   * Returns the number of bytes the sender may have in flight.
+   */
+  uint32_t (*cwnd)(ctcp_cc_t *cc);
+
+  /**
+   * Called with a delivery rate sample for every ACK that reports data
+   * delivered, loss recovery or not. NULL if the algorithm has no use for
+   * them.
+   */
+  void (*on_rate_sample)(ctcp_cc_t *cc, const cc_rate_sample_t *rs);
+
+  /**
+   * Returns the rate to pace segments out at, in bytes per second, 0 if the
+   * algorithm has none yet. NULL if the algorithm leaves pacing to --pace.
+   * Connections using an algorithm with this hook are always paced.
+   */
+  uint64_t (*pacing_rate)(ctcp_cc_t *cc);
+} ctcp_cc_ops_t;
+
+struct ctcp_cc {
+  const ctcp_cc_ops_t *ops; /* The algorithm in use */
+  uint32_t mss;             /* Maximum segment size */
+  uint32_t cwnd;            /* Congestion window */
+  uint32_t ssthresh;        /* Slow start threshold */
+  uint32_t acked_bytes;     /* Bytes acknowledged towards the next window
+                               increase in congestion avoidance */
+
+  /* CUBIC (RFC 8312). Windows are in segments, times in seconds. */
+  struct {
+    double w_max;           /* Window just before the last reduction */
+    double k;               /* Time to grow back to w_max */
+    double origin;          /* Plateau of the cubic function */
+    double w_est;           /* Estimate of what Reno would have */
+    long epoch_start;       /* When the current epoch started, in ms */
+  } cubic;
+
+  /* BBR. Rates are in bytes per second, times in us, gains in percent. */
+  struct {
+    int mode;               /* One of the BBR_* modes in ctcp_cc.c */
+    uint64_t bw[BBR_BW_ROUNDS];
+                            /* Highest delivery rate in each recent round */
+    uint32_t round;         /* Round trips so far */
+    uint64_t round_end;     /* Bytes delivered in all that end this round */
+    long min_rtt;           /* Lowest RTT seen lately, 0 if none yet */
+    long min_rtt_stamp;     /* When min_rtt was last set */
+    int pacing_gain;        /* Pacing rate over the bandwidth estimate */
+    int cwnd_gain;          /* Window over the bandwidth-delay product */
+    int cycle;              /* Phase of the gain cycle in PROBE_BW */
+    long cycle_stamp;       /* When that phase started */
+    uint64_t full_bw;       /* Bandwidth when it last grew by 25% */
+    int full_bw_rounds;     /* Rounds since then */
+    bool full_pipe;         /* Whether startup has filled the pipe */
+    long probe_rtt_done;    /* When PROBE_RTT may end, 0 if not yet known */
+    uint32_t prior_cwnd;    /* Window to go back to after PROBE_RTT */
+  } bbr;
+};
+
+/**
+ * Looks up a congestion control algorithm by name.
+ *
+ * name: The name, e.g. "newreno", "cubic" or "bbr".
+ * returns: The algorithm (one of the CC_* constants), -1 if not found.
+ */
+int cc_lookup(const char *name);
+
+/**
+ * Sets up congestion control state for a new connection.
+ *
+ * cc: The state to set up.
+ * algorithm: One of the CC_* constants.
+ * mss: Maximum segment size, in bytes.
+ */
+void cc_init(ctcp_cc_t *cc, int algorithm, uint32_t mss);
+
+/** Convenience wrappers around the algorithm's hooks. */
+static inline void cc_on_ack(ctcp_cc_t *cc, uint32_t acked, long srtt) {
+  cc->ops->on_ack(cc, acked, srtt);
+}
+static inline void cc_on_loss(ctcp_cc_t *cc, uint32_t in_flight) {
+  cc->ops->on_loss(cc, in_flight);
+}
+static inline void cc_on_timeout(ctcp_cc_t *cc, uint32_t in_flight) {
+  cc->ops->on_timeout(cc, in_flight);
+}
+static inline void cc_undo(ctcp_cc_t *cc, const ctcp_cc_t *prior) {
+  cc->ops->undo(cc, prior);
+}
+static inline uint32_t cc_cwnd(ctcp_cc_t *cc) {
+  return cc->ops->cwnd(cc);
+}
+static inline void cc_on_rate_sample(ctcp_cc_t *cc,
+                                     const cc_rate_sample_t *rs) {
+  if (cc->ops->on_rate_sample)
+    cc->ops->on_rate_sample(cc, rs);
+}
+static inline bool cc_paces(ctcp_cc_t *cc) {
+  return cc->ops->pacing_rate != NULL;
+}
+static inline uint64_t cc_pacing_rate(ctcp_cc_t *cc) {
+  return cc->ops->pacing_rate ? cc->ops->pacing_rate(cc) : 0;
+}
+
+#endif /* CTCP_CC_H */
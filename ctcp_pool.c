@@ -0,0 +1,60 @@
+#include "ctcp_pool.h"
+
+/** Bookkeeping in front of every buffer. */
+struct pool_buf {
+  pool_buf_t *next;         /* Next free buffer, while on a free list */
+  size_t size;              /* Capacity of the buffer */
+  char data[];              /* The buffer itself */
+};
+
+void pool_init(ctcp_pool_t *pool, ctcp_arena_t *arena, size_t small,
+               size_t large) {
+  int i;
+  pool->arena = arena;
+  pool->size[POOL_SMALL] = small;
+  pool->size[POOL_LARGE] = large;
+  for (i = 0; i < NUM_POOL_CLASSES; i++)
+    pool->free[i] = NULL;
+  pool->hits = 0;
+  pool->misses = 0;
+}
+
+void *pool_alloc(ctcp_pool_t *pool, size_t len) {
+  size_t size = len;
+  int i;
+  for (i = 0; i < NUM_POOL_CLASSES; i++) {
+    if (len > pool->size[i])
+      continue;
+    size = pool->size[i];
+    if (pool->free[i] != NULL) {
+      pool_buf_t *buf = pool->free[i];
+      pool->free[i] = buf->next;
+      pool->hits++;
+      return buf->data;
+    }
+    break;
+  }
+
+  pool->misses++;
+  pool_buf_t *buf = arena_alloc(pool->arena, sizeof(pool_buf_t) + size);
+  buf->size = size;
+  return buf->data;
+}
+
+void pool_free(ctcp_pool_t *pool, void *data) {
+  if (data == NULL)
+    return;
+  pool_buf_t *buf = (pool_buf_t *) ((char *) data - sizeof(pool_buf_t));
+
+  /* Only buffers of exactly a class's size go on its free list. Anything
+     else was too big for any class. */
+  int i;
+  for (i = 0; i < NUM_POOL_CLASSES; i++) {
+    if (buf->size == pool->size[i]) {
+      buf->next = pool->free[i];
+      pool->free[i] = buf;
+      return;
+    }
+  }
+  arena_free(pool->arena, buf, sizeof(pool_buf_t) + buf->size);
+}
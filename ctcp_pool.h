@@ -0,0 +1,73 @@
+/******************************************************************************
+ * ctcp_pool.h
+ * -----------
+ * Segment buffer pool. Every segment sent or received needs a few buffers: a
+ * cTCP segment and the raw packet it is sent or received as. Rather than
+ * going through malloc and free for each, freed buffers are kept on free
+ * lists, one per size class, and handed out again. Each connection has a pool
+ * of its own (see conn_pool()), backed by the connection's arena, so every
+ * buffer is released along with the connection.
+ *
+ * There are two classes: headers and options only, e.g. for pure ACKs and
+ * other small objects, and a full packet of the largest segment size. A
+ * buffer that fits neither is allocated by itself and freed when given back.
+ * Buffers are not zeroed.
+ *
+ *****************************************************************************/
+
+#ifndef CTCP_POOL_H
+#define CTCP_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ctcp_arena.h"
+
+/** Size classes. */
+#define POOL_SMALL 0
+#define POOL_LARGE 1
+#define NUM_POOL_CLASSES 2
+
+/** A buffer, preceded by the pool's bookkeeping. */
+typedef struct pool_buf pool_buf_t;
+
+/** Per-connection segment buffer pool. */
+typedef struct {
+  ctcp_arena_t *arena;      /* Where buffers come from */
+  size_t size[NUM_POOL_CLASSES];
+                            /* Capacity of each class's buffers */
+  pool_buf_t *free[NUM_POOL_CLASSES];
+                            /* Free buffers of each class */
+  uint32_t hits;            /* Allocations served from a free list */
+  uint32_t misses;          /* Allocations that went to the arena */
+} ctcp_pool_t;
+
+/**
+ * Sets up an empty pool.
+ *
+ * pool: The pool to set up.
+ * arena: Arena to allocate buffers from.
+ * small: Capacity of small buffers, in bytes.
+ * large: Capacity of large buffers, in bytes.
+ */
+void pool_init(ctcp_pool_t *pool, ctcp_arena_t *arena, size_t small,
+               size_t large);
+
+/**
+ * Gets a buffer of at least the given size. Its contents are undefined.
+ *
+ * pool: The pool.
+ * len: Size needed, in bytes.
+ * returns: The buffer. Give it back with pool_free().
+ */
+void *pool_alloc(ctcp_pool_t *pool, size_t len);
+
+/**
+ * Gives a buffer back to the pool it came from.
+ *
+ * pool: The pool.
+ * buf: The buffer, from pool_alloc(). Nothing happens if it is NULL.
+ */
+void pool_free(ctcp_pool_t *pool, void *buf);
+
+#endif /* CTCP_POOL_H */
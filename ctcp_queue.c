@@ -0,0 +1,119 @@
+#include "ctcp_queue.h"
+
+void queue_init(queue_t *queue) {
+  queue->head = NULL;
+  queue->tail = NULL;
+  queue->length = 0;
+}
+
+void queue_push_back(queue_t *queue, queue_link_t *link) {
+  link->next = NULL;
+  link->prev = queue->tail;
+  if (queue->tail != NULL)
+    queue->tail->next = link;
+  else
+    queue->head = link;
+  queue->tail = link;
+  queue->length++;
+}
+
+void queue_push_front(queue_t *queue, queue_link_t *link) {
+  link->prev = NULL;
+  link->next = queue->head;
+  if (queue->head != NULL)
+    queue->head->prev = link;
+  else
+    queue->tail = link;
+  queue->head = link;
+  queue->length++;
+}
+
+void queue_insert_after(queue_t *queue, queue_link_t *after,
+                        queue_link_t *link) {
+  link->prev = after;
+  link->next = after->next;
+  if (after->next != NULL)
+    after->next->prev = link;
+  else
+    queue->tail = link;
+  after->next = link;
+  queue->length++;
+}
+
+void queue_remove(queue_t *queue, queue_link_t *link) {
+  if (link->prev != NULL)
+    link->prev->next = link->next;
+  else
+    queue->head = link->next;
+  if (link->next != NULL)
+    link->next->prev = link->prev;
+  else
+    queue->tail = link->prev;
+  link->next = NULL;
+  link->prev = NULL;
+  queue->length--;
+}
+
+queue_link_t *queue_front(queue_t *queue) {
+  return queue->head;
+}
+
+unsigned int queue_length(queue_t *queue) {
+  return queue->length;
+}
+
+void ring_init(ring_t *ring, ctcp_arena_t *arena, size_t elem_size,
+               uint32_t capacity) {
+  ring->arena = arena;
+  ring->elem_size = elem_size;
+  ring->capacity = 1;
+  while (ring->capacity < capacity)
+    ring->capacity <<= 1;
+  ring->buf = arena_alloc(arena, ring->capacity * elem_size);
+  ring->head = 0;
+  ring->length = 0;
+}
+
+void *ring_at(ring_t *ring, uint32_t i) {
+  return ring->buf + ((ring->head + i) & (ring->capacity - 1)) *
+    ring->elem_size;
+}
+
+void *ring_push(ring_t *ring) {
+  /* Full. Double the storage, unwrapping the elements to its start. */
+  if (ring->length == ring->capacity) {
+    char *buf = arena_alloc(ring->arena,
+                            2 * ring->capacity * ring->elem_size);
+    uint32_t first = ring->capacity - ring->head;
+    if (first > ring->length)
+      first = ring->length;
+    memcpy(buf, ring_at(ring, 0), first * ring->elem_size);
+    memcpy(buf + first * ring->elem_size, ring->buf,
+           (ring->length - first) * ring->elem_size);
+    arena_free(ring->arena, ring->buf, ring->capacity * ring->elem_size);
+    ring->buf = buf;
+    ring->capacity *= 2;
+    ring->head = 0;
+  }
+
+  void *elem = ring_at(ring, ring->length);
+  ring->length++;
+  memset(elem, 0, ring->elem_size);
+  return elem;
+}
+
+void ring_pop_front(ring_t *ring, uint32_t n) {
+  ring->head = (ring->head + n) & (ring->capacity - 1);
+  ring->length -= n;
+}
+
+void ring_remove(ring_t *ring, uint32_t i, uint32_t n) {
+  uint32_t j;
+  for (j = i + n; j < ring->length; j++)
+    memcpy(ring_at(ring, j - n), ring_at(ring, j), ring->elem_size);
+  ring->length -= n;
+}
+
+uint32_t ring_length(ring_t *ring) {
+  return ring->length;
+}
@@ -0,0 +1,158 @@
+/******************************************************************************
+ * ctcp_queue.h
+ * ------------
+ * Queues that do not allocate per element, for the per-segment hot paths.
+ *
+ * queue_t is an intrusive doubly linked list: the links live inside the
+ * objects themselves (a queue_link_t member), so adding and removing never
+ * calls malloc or free. queue_entry() gets from a link back to its object.
+ *
+ * ring_t holds fixed-size elements by value in a circular array that doubles
+ * when it fills up. Elements stay in the order they were pushed and can be
+ * indexed, which suits anything kept sorted by sequence number. Its storage
+ * comes from an arena and goes along with it.
+ *
+ *****************************************************************************/
+
+#ifndef CTCP_QUEUE_H
+#define CTCP_QUEUE_H
+
+#include "ctcp_sys.h"
+
+/** Link embedded in each object on a queue. */
+typedef struct queue_link {
+  struct queue_link *next;  /* Next link, NULL at the back */
+  struct queue_link *prev;  /* Previous link, NULL at the front */
+} queue_link_t;
+
+/** An intrusive queue. */
+typedef struct {
+  queue_link_t *head;
+  queue_link_t *tail;
+  unsigned int length;
+} queue_t;
+
+/**
+ * Gets the object a link is embedded in.
+ *
+ * link: The link.
+ * type: Type of the object.
+ * member: Name of the link within the object.
+ */
+#define queue_entry(link, type, member) \
+  ((type *) ((char *) (link) - offsetof(type, member)))
+
+/**
+ * Sets up an empty queue.
+ */
+void queue_init(queue_t *queue);
+
+/**
+ * Adds an object to the back of the queue.
+ *
+ * queue: The queue.
+ * link: The object's link. It must not be on any queue.
+ */
+void queue_push_back(queue_t *queue, queue_link_t *link);
+
+/**
+ * Adds an object to the front of the queue.
+ *
+ * queue: The queue.
+ * link: The object's link. It must not be on any queue.
+ */
+void queue_push_front(queue_t *queue, queue_link_t *link);
+
+/**
+ * Adds an object right after another one already on the queue.
+ *
+ * queue: The queue.
+ * after: Link of the object to add after.
+ * link: The object's link. It must not be on any queue.
+ */
+void queue_insert_after(queue_t *queue, queue_link_t *after,
+                        queue_link_t *link);
+
+/**
+ * Takes an object off the queue. The object itself is left alone.
+ *
+ * queue: The queue.
+ * link: The object's link.
+ */
+void queue_remove(queue_t *queue, queue_link_t *link);
+
+/**
+ * Returns the link at the front of the queue, NULL if it is empty.
+ */
+queue_link_t *queue_front(queue_t *queue);
+
+/**
+ * Returns the number of objects on the queue.
+ */
+unsigned int queue_length(queue_t *queue);
+
+/** A ring of fixed-size elements. */
+typedef struct {
+  ctcp_arena_t *arena;      /* Where the storage comes from */
+  char *buf;                /* Element storage */
+  size_t elem_size;         /* Size of an element, in bytes */
+  uint32_t capacity;        /* Number of elements buf holds, a power of 2 */
+  uint32_t head;            /* Index in buf of the first element */
+  uint32_t length;          /* Number of elements */
+} ring_t;
+
+/**
+ * Sets up an empty ring.
+ *
+ * ring: The ring.
+ * arena: Arena to allocate storage from.
+ * elem_size: Size of an element, in bytes.
+ * capacity: Number of elements to make room for up front. Rounded up to a
+ *           power of 2.
+ */
+void ring_init(ring_t *ring, ctcp_arena_t *arena, size_t elem_size,
+               uint32_t capacity);
+
+/**
+ * Adds an element to the back of the ring, making room if needed.
+ *
+ * ring: The ring.
+ * returns: The new element, zeroed. Like any element, it stays where it is
+ *          only until the next push or removal.
+ */
+void *ring_push(ring_t *ring);
+
+/**
+ * Gets an element by its position.
+ *
+ * ring: The ring.
+ * i: Position of the element, 0 being the front. Must be less than the
+ *    ring's length.
+ * returns: The element.
+ */
+void *ring_at(ring_t *ring, uint32_t i);
+
+/**
+ * Removes elements from the front of the ring.
+ *
+ * ring: The ring.
+ * n: Number of elements to remove. Must not be more than the ring holds.
+ */
+void ring_pop_front(ring_t *ring, uint32_t n);
+
+/**
+ * Removes elements from anywhere in the ring. The elements after them move
+ * up to close the gap, which takes time proportional to their number.
+ *
+ * ring: The ring.
+ * i: Position of the first element to remove.
+ * n: Number of elements to remove.
+ */
+void ring_remove(ring_t *ring, uint32_t i, uint32_t n);
+
+/**
+ * Returns the number of elements in the ring.
+ */
+uint32_t ring_length(ring_t *ring);
+
+#endif /* CTCP_QUEUE_H */
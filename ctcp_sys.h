@@ -32,6 +32,8 @@
 #include <sys/time.h>
 #include <sys/un.h>
 
+#include "ctcp_pool.h"
+
 /** Connection object. Used to identify the receiver of sent segments.
     Definition can be found in ctcp_sys_internal.c. */
 typedef struct conn conn_t;
@@ -70,6 +72,18 @@ typedef struct ctcp_segment {
  */
 int conn_input(conn_t *conn, void *buf, size_t len);
 
+/**
+ * Call on this to stop or resume reading input for a connection, e.g. while
+ * there is no room to put more of it. While input is held, the library does
+ * not poll for it and so does not call ctcp_read(), which would otherwise be
+ * called over and over for input that is still waiting. Once resumed,
+ * ctcp_read() is called again if input is available.
+ *
+ * conn: The connection object.
+ * hold: Whether to stop (true) or resume (false) reading input.
+ */
+void conn_hold_input(conn_t *conn, bool hold);
+
 /**
  * Call on this to send a cTCP segment to a destination associated with the
  * provided connection object.
@@ -116,11 +130,44 @@ int conn_output(conn_t *conn, const char *buf, size_t len);
  * conn_bufspace() is guaranteed to return a non-zero value the next time you
  * call it (meaning that there is still room to write out more).
  *
+ * Once the output buffer (--output-buffer bytes) fills up, this returns 0
+ * until it has drained to its low watermark, half of its size. ctcp_output()
+ * is called at that point, so there is no need to poll.
+ *
  * conn: The connection object.
  * returns: The number of bytes that can be written out.
  */
 size_t conn_bufspace(conn_t *conn);
 
+/**
+ * Asks for ctcp_wakeup() to be called for a connection once a given time has
+ * come, e.g. to send segments held back by pacing. Only the latest time asked
+ * for counts.
+ *
+ * conn: The connection object.
+ * when: The time, in microseconds (see current_time_us()). 0 cancels it.
+ */
+void conn_wakeup(conn_t *conn, long when);
+
+/**
+ * Gets a connection's segment buffer pool. Segments passed to ctcp_receive()
+ * come from it, so free them with pool_free() on this pool rather than with
+ * free().
+ *
+ * conn: The connection object.
+ * returns: The pool.
+ */
+ctcp_pool_t *conn_pool(conn_t *conn);
+
+/**
+ * Gets a connection's memory arena. Memory allocated from it is released when
+ * the connection is freed, after ctcp_destroy() returns.
+ *
+ * conn: The connection object.
+ * returns: The arena.
+ */
+ctcp_arena_t *conn_arena(conn_t *conn);
+
 /**
  * Used to remove a connection object. This is already called on in the starter
  * code in ctcp_destroy(), so you do not need to add calls to it.
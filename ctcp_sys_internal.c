@@ -10,6 +10,7 @@
  * this file.
  *****************************************************************************/
 
+#define _GNU_SOURCE
 #include <errno.h>
 #include <poll.h>
 #include <pthread.h>
@@ -19,6 +20,7 @@
 
 #include "ctcp_sys_internal.h"
 #include "ctcp_sys.h"
+#include "ctcp_cc.h"
 
 #define ASSERT_CLIENT_ONLY (assert(!SERVER))
 #define ASSERT_SERVER_ONLY (assert(SERVER))
@@ -52,6 +54,26 @@ static ctcp_config_t *ctcp_cfg;
 /** Whether or not a Unix socket is being used instead of a normal socket. */
 static bool unix_socket = true;
 
+/** Whether to offer SACK in the handshake. */
+static bool offer_sack = false;
+
+/** Whether to offer timestamp options in the handshake. */
+static bool offer_timestamps = false;
+
+/** Segment data size to offer over a Unix socket. */
+static int unix_mss = UNIX_SEG_DATA_SIZE;
+
+/** Space for buffering each connection's output, in bytes. */
+static size_t out_buf_size = DEFAULT_OUT_BUF_SIZE;
+
+/** Weights given to clients by port, for the scheduler. Other clients get
+    the default weight. */
+static struct {
+  int port;
+  int weight;
+} client_weights[MAX_CLIENT_WEIGHTS];
+static int num_client_weights = 0;
+
 /** Whether or not the server runs a program. */
 static bool run_program = false;
 
@@ -78,7 +100,8 @@ static int new_connection = 0;
  *    0    STDIN
  *    1    STDOUT
  *    2    Network
- *    3... Program STDOUT/STDERR (if running as server)
+ *    3... Program STDOUT/STDERR and STDIN, two slots per program (if running
+ *         as server)
  */
 static struct pollfd *events;
 
@@ -88,6 +111,22 @@ static struct timespec last_timeout;
 /** Number of clients connected. MAX_NUM_CLIENTS can be connected. */
 static int num_connected = 0;
 
+/** Connections whose program is polled, in the order of their pairs of
+    slots in events after the first NUM_POLL. */
+static conn_t **polled_conns;
+static int num_polled = 0;
+
+/** Connections by peer address and port, for recv_filter(). Each bucket is
+    a list chained through hash_next. The table doubles whenever there are
+    more connections than buckets. */
+static conn_t **conn_table = NULL;
+static int conn_table_bits = 0;
+static int conn_table_count = 0;
+
+/** Connection the last packet was for. In a bulk transfer, nearly every
+    packet is for the same one. */
+static conn_t *last_conn = NULL;
+
 /** Main thread and thread for sending rests. */
 static pthread_t thread_main;
 static pthread_t thread_resets;
@@ -218,8 +257,7 @@ int do_config_server(char *server) { ASSERT_CLIENT_ONLY;
   }
   server_port_str = strsep(&server, ":");
   server_port = atoi(server_port_str);
-  config->sconn = calloc(sizeof(conn_t), 1);
-  conn_add(config->sconn);
+  conn_t *conn = conn_create();
 
   /* Get IP address of server. See if this is a server on the same machine. */
   in_addr_t dst_ip = ip_from_hostname(_server);
@@ -230,7 +268,8 @@ int do_config_server(char *server) { ASSERT_CLIENT_ONLY;
 
   /* Set up connection details. */
   int port = server_port == 0 ? DEFAULT_PORT : server_port;
-  conn_setup(config->sconn, dst_ip, port, unix_socket);
+  conn_setup(conn, dst_ip, port, unix_socket);
+  conn_add(conn);
 
   return 0;
 }
@@ -267,6 +306,191 @@ char *create_tcp_rst(in_addr_t ip_dst, uint16_t port_src, uint16_t port_dst,
   return datagram;
 }
 
+/**
+ * Returns the MSS this host offers. Over a Unix socket, segments can be much
+ * larger than on the wire.
+ */
+uint16_t local_mss(void) {
+  return unix_socket ? unix_mss : MAX_SEG_DATA_SIZE;
+}
+
+/**
+ * Returns the largest packet this host may receive, headers included.
+ */
+size_t local_packet_size(void) {
+  return FULL_HDR_SIZE + MAX_OPT_SIZE + local_mss();
+}
+
+/**
+ * Sets up a new connection's segment pool and output buffer.
+ *
+ * conn: The connection object.
+ */
+void conn_init_buffers(conn_t *conn) {
+  pool_init(&conn->pool, conn->arena, FULL_HDR_SIZE + MAX_OPT_SIZE,
+            local_packet_size());
+  conn->out_buf = arena_alloc(conn->arena, out_buf_size);
+  conn->out_size = out_buf_size;
+}
+
+/**
+ * Returns the window-scale shift this host uses: the smallest one that lets
+ * the largest receive window fit in the 16-bit window field (RFC 7323).
+ */
+uint8_t local_wscale(void) {
+  uint8_t shift = 0;
+  while (shift < TCP_MAX_WINSHIFT &&
+         (ctcp_cfg->max_recv_window >> shift) > UINT16_MAX)
+    shift++;
+  return shift;
+}
+
+/**
+ * Writes the options of a SYN or SYN-ACK: the MSS, the window scale and, if
+ * turned on, SACK-permitted and timestamps. A SYN-ACK only offers window
+ * scaling, SACK and timestamps back if the SYN did.
+ *
+ * dst: A conn_t containing details for the destination.
+ * flags: TCP flags.
+ * opts: Where to write the options. Must have room for 24 bytes.
+ * returns: Length of the options, in bytes.
+ */
+int write_syn_options(conn_t *dst, uint8_t flags, uint8_t *opts) {
+  bool synack = (flags & TH_ACK) != 0;
+  uint16_t mss = htons(local_mss());
+  int len = TCPOLEN_MAXSEG;
+  opts[0] = TCPOPT_MAXSEG;
+  opts[1] = TCPOLEN_MAXSEG;
+  memcpy(opts + 2, &mss, sizeof(uint16_t));
+
+  if (!synack || dst->wscale_ok) {
+    opts[len++] = TCPOPT_NOP;
+    opts[len++] = TCPOPT_WINDOW;
+    opts[len++] = TCPOLEN_WINDOW;
+    opts[len++] = local_wscale();
+  }
+
+  if (offer_sack && (!synack || dst->sack_ok)) {
+    opts[len++] = TCPOPT_NOP;
+    opts[len++] = TCPOPT_NOP;
+    opts[len++] = TCPOPT_SACK_PERMITTED;
+    opts[len++] = TCPOLEN_SACK_PERMITTED;
+  }
+
+  if (offer_timestamps && (!synack || dst->ts_ok)) {
+    uint32_t ts_val = htonl(current_time());
+    uint32_t ts_ecr = htonl(synack ? dst->ts_recent : 0);
+    opts[len++] = TCPOPT_NOP;
+    opts[len++] = TCPOPT_NOP;
+    opts[len++] = TCPOPT_TIMESTAMP;
+    opts[len++] = TCPOLEN_TIMESTAMP;
+    memcpy(opts + len, &ts_val, sizeof(uint32_t));
+    memcpy(opts + len + 4, &ts_ecr, sizeof(uint32_t));
+    len += 8;
+  }
+  return len;
+}
+
+/**
+ * Reads the MSS, window-scale, SACK-permitted and timestamp options of a
+ * received SYN or SYN-ACK. Malformed options are ignored along with
+ * everything after them.
+ *
+ * tcp_hdr: The TCP header.
+ * tcp_len: Length of the TCP segment, including the header.
+ * mss: Set to the MSS option. Left alone if there is none.
+ * wscale: Set to the window-scale shift. Left alone if there is none.
+ * sack: Set to true if SACK is permitted. Left alone if not.
+ * ts_val: Set to the timestamp. Left alone if there is none.
+ */
+void read_syn_options(tcphdr_t *tcp_hdr, int tcp_len, uint16_t *mss,
+                      int *wscale, bool *sack, int64_t *ts_val) {
+  uint8_t *opts = (uint8_t *) tcp_hdr + TCP_HDR_SIZE;
+  int len = tcp_hdr->th_off * 4 - TCP_HDR_SIZE;
+  if (len > tcp_len - (int) TCP_HDR_SIZE)
+    return;
+
+  int i = 0;
+  while (i < len && opts[i] != TCPOPT_EOL) {
+    if (opts[i] == TCPOPT_NOP) {
+      i++;
+      continue;
+    }
+    if (i + 1 >= len || opts[i + 1] < 2 || i + opts[i + 1] > len)
+      return;
+
+    if (opts[i] == TCPOPT_MAXSEG && opts[i + 1] == TCPOLEN_MAXSEG) {
+      memcpy(mss, opts + i + 2, sizeof(uint16_t));
+      *mss = ntohs(*mss);
+    }
+    else if (opts[i] == TCPOPT_WINDOW && opts[i + 1] == TCPOLEN_WINDOW) {
+      *wscale = opts[i + 2];
+      if (*wscale > TCP_MAX_WINSHIFT)
+        *wscale = TCP_MAX_WINSHIFT;
+    }
+    else if (opts[i] == TCPOPT_SACK_PERMITTED &&
+             opts[i + 1] == TCPOLEN_SACK_PERMITTED) {
+      *sack = true;
+    }
+    else if (opts[i] == TCPOPT_TIMESTAMP &&
+             opts[i + 1] == TCPOLEN_TIMESTAMP) {
+      uint32_t ts;
+      memcpy(&ts, opts + i + 2, sizeof(uint32_t));
+      *ts_val = ntohl(ts);
+    }
+    i += opts[i + 1];
+  }
+}
+
+/**
+ * Fills in what the handshake settled on in a connection's configuration:
+ * the other side's MSS and window, the window scales and whether to use SACK
+ * and timestamps. Window scaling, SACK and timestamps are on if the other
+ * side's SYN or SYN-ACK offered them: a SYN-ACK only does if this host's SYN
+ * did, and a SYN gets them offered back. Without window scaling, the receive window is
+ * capped at what fits in 16 bits.
+ *
+ * conn: The connection.
+ * cfg: The connection's configuration.
+ * tcp_hdr: TCP header of the SYN or SYN-ACK from the other side.
+ * tcp_len: Length of that TCP segment, including the header.
+ */
+void apply_syn_options(conn_t *conn, ctcp_config_t *cfg, tcphdr_t *tcp_hdr,
+                       int tcp_len) {
+  /* Older cTCP hosts do not send an MSS option. They use the Ethernet-sized
+     segments. */
+  uint16_t mss = MAX_SEG_DATA_SIZE;
+  int wscale = -1;
+  bool sack = false;
+  int64_t ts_val = -1;
+  read_syn_options(tcp_hdr, tcp_len, &mss, &wscale, &sack, &ts_val);
+  conn->wscale_ok = wscale >= 0;
+  conn->sack_ok = offer_sack && sack;
+  cfg->sack = conn->sack_ok;
+  conn->ts_ok = offer_timestamps && ts_val >= 0;
+  if (conn->ts_ok)
+    conn->ts_recent = ts_val;
+  cfg->timestamps = conn->ts_ok;
+
+  cfg->mss = mss < local_mss() ? mss : local_mss();
+  cfg->send_window = ntohs(tcp_hdr->th_win);
+  if (wscale >= 0) {
+    cfg->snd_wscale = wscale;
+    cfg->rcv_wscale = local_wscale();
+  }
+  else {
+    uint32_t limit = UINT16_MAX - UINT16_MAX % MAX_SEG_DATA_SIZE;
+    cfg->snd_wscale = 0;
+    cfg->rcv_wscale = 0;
+    if (cfg->recv_window > limit)
+      cfg->recv_window = limit;
+    if (cfg->max_recv_window > limit)
+      cfg->max_recv_window = limit;
+  }
+  conn->rcv_wscale = cfg->rcv_wscale;
+  conn->recv_window = cfg->recv_window;
+}
+
 /**
  * Creates a TCP segment (including the IP header). The returned segment must
  * be freed.
@@ -279,33 +503,48 @@ char *create_tcp_rst(in_addr_t ip_dst, uint16_t port_src, uint16_t port_dst,
  * returns: A TCP segment with the specified fields.
  */
 char *create_tcp_seg(conn_t *dst, uint8_t flags, char *data, uint16_t len) {
-  uint16_t tcp_seg_len = TCP_HDR_SIZE + len;
+  uint8_t opts[MAX_OPT_SIZE];
+  uint16_t opt_len = 0;
+  if (flags & TH_SYN)
+    opt_len = write_syn_options(dst, flags, opts);
+
+  uint16_t tcp_seg_len = TCP_HDR_SIZE + opt_len + len;
   char *datagram = create_datagram(config->ip_addr, dst->ip_addr, tcp_seg_len);
   iphdr_t *ip_hdr = (iphdr_t *) datagram;
   tcphdr_t *tcp_hdr = (tcphdr_t *) (datagram + IP_HDR_SIZE);
 
-  /* Copy data over, if there is any. */
+  /* Copy options and data over, if there are any. */
+  memcpy((uint8_t *) tcp_hdr + TCP_HDR_SIZE, opts, opt_len);
   if (len > 0 && data != NULL) {
-    char *payload = (char *)((uint8_t *) tcp_hdr + TCP_HDR_SIZE);
+    char *payload = (char *)((uint8_t *) tcp_hdr + TCP_HDR_SIZE + opt_len);
     memcpy(payload, data, len);
   }
 
-  uint16_t window = 0;
-  if (!(flags & TH_RST))
-    window = htons(ctcp_cfg->recv_window);
+  /* The window in a SYN or SYN-ACK is never scaled. Only a SYN goes out
+     before the other side's options are known. After that, the window is
+     the connection's own, capped if the other side does not scale it. */
+  uint32_t window = 0;
+  if (flags == TH_SYN)
+    window = ctcp_cfg->recv_window;
+  else if (flags & TH_SYN)
+    window = dst->recv_window;
+  else if (!(flags & TH_RST))
+    window = dst->recv_window >> dst->rcv_wscale;
+  if (window > UINT16_MAX)
+    window = UINT16_MAX;
 
   /* TCP header. */
   tcp_hdr->th_sport = htons(config->port);
   tcp_hdr->th_dport = htons(dst->port);
   tcp_hdr->th_seq = htonl(dst->next_seqno);
   tcp_hdr->th_ack = htonl(dst->ackno);
-  tcp_hdr->th_off = TCP_HDR_SIZE / 4;
+  tcp_hdr->th_off = (TCP_HDR_SIZE + opt_len) / 4;
   tcp_hdr->th_flags = flags;
-  tcp_hdr->th_win = window;
+  tcp_hdr->th_win = htons(window);
   tcp_hdr->th_sum = 0;
 
   /* TCP checksum. */
-  tcp_hdr->th_sum = cksum_tcp(ip_hdr, len);
+  tcp_hdr->th_sum = cksum_tcp(ip_hdr, opt_len + len);
 
   /* Update sequence numbers. */
   dst->seqno = dst->next_seqno;
@@ -314,6 +553,38 @@ char *create_tcp_seg(conn_t *dst, uint8_t flags, char *data, uint16_t len) {
   return datagram;
 }
 
+/**
+ * Shifts the edges of any SACK blocks in a segment's options. SACK edges are
+ * acknowledgement numbers, so they need the same conversion between relative
+ * and real sequence numbers as the ackno does.
+ *
+ * opts: Start of the options.
+ * len: Length of the options, in bytes.
+ * delta: Amount to add to each edge.
+ */
+void translate_sack(uint8_t *opts, int len, uint32_t delta) {
+  int i = 0;
+  while (i < len && opts[i] != TCPOPT_EOL) {
+    if (opts[i] == TCPOPT_NOP) {
+      i++;
+      continue;
+    }
+    if (i + 1 >= len || opts[i + 1] < 2 || i + opts[i + 1] > len)
+      return;
+
+    if (opts[i] == TCPOPT_SACK) {
+      int j;
+      for (j = i + 2; j + 4 <= i + opts[i + 1]; j += 4) {
+        uint32_t edge;
+        memcpy(&edge, opts + j, sizeof(uint32_t));
+        edge = htonl(ntohl(edge) + delta);
+        memcpy(opts + j, &edge, sizeof(uint32_t));
+      }
+    }
+    i += opts[i + 1];
+  }
+}
+
 /**
  * Converts a packet from a raw IP packet to a cTCP segment. If there is
  * padding, keep it. The resulting segment must be freed.
@@ -331,7 +602,8 @@ ctcp_segment_t *convert_to_ctcp(conn_t *src, char *datagram, int actual_len) {
   /* Get actual lengths and allocate cTCP segment of correct size. */
   uint16_t data_len = ntohs(ip_hdr->tot_len) - FULL_HDR_SIZE;
   uint16_t len = data_len + sizeof(ctcp_segment_t);
-  ctcp_segment_t *segment = calloc(len, 1);
+  ctcp_segment_t *segment = pool_alloc(&src->pool, len);
+  memset(segment, 0, sizeof(ctcp_segment_t));
 
   /* Set fields of cTCP segment. Convert sequence numbers to relative
      sequence numbers. */
@@ -343,6 +615,13 @@ ctcp_segment_t *convert_to_ctcp(conn_t *src, char *datagram, int actual_len) {
   segment->cksum = 0;
   if (data_len > 0)
     memcpy(segment->data, payload, data_len);
+
+  /* TCP options are kept at the start of the cTCP data. */
+  uint16_t opt_len = tcp_hdr->th_off * 4 - TCP_HDR_SIZE;
+  if (tcp_hdr->th_off > TCP_HDR_SIZE / 4 && opt_len <= data_len) {
+    segment->flags |= htonl((opt_len / 4) << OPT_WORDS_SHIFT);
+    translate_sack((uint8_t *) segment->data, opt_len, -src->init_seqno);
+  }
   segment->cksum = cksum(segment, len);
 
   /* Find the difference in the given TCP checksum and the correct one. This
@@ -358,7 +637,7 @@ ctcp_segment_t *convert_to_ctcp(conn_t *src, char *datagram, int actual_len) {
 
 /**
  * Converts a segment from a cTCP segment to a raw IP packet. The resulting
- * packet must be freed.
+ * packet must be given back to the connection's pool.
  *
  * dst: A conn_t containing connection details of the packet's receiver.
  * segment: The cTCP segment.
@@ -368,15 +647,21 @@ ctcp_segment_t *convert_to_ctcp(conn_t *src, char *datagram, int actual_len) {
 char *convert_to_datagram(conn_t *dst, ctcp_segment_t *segment, int len) {
   /* Create IP packet with TCP payload. */
   uint16_t tcp_pkt_len = len - sizeof(ctcp_segment_t) + TCP_HDR_SIZE;
-  char *datagram = create_datagram(config->ip_addr, dst->ip_addr, tcp_pkt_len);
+  char *datagram = pool_alloc(&dst->pool, IP_HDR_SIZE + tcp_pkt_len);
+  memset(datagram, 0, FULL_HDR_SIZE);
+  init_datagram(datagram, config->ip_addr, dst->ip_addr, tcp_pkt_len);
   iphdr_t *ip_hdr = (iphdr_t *) datagram;
   tcphdr_t *tcp_hdr = (tcphdr_t *) (datagram + IP_HDR_SIZE);
 
   /* Copy data over, if there is any. */
   uint16_t data_len = len - sizeof(ctcp_segment_t);
+  uint16_t opt_len = ((ntohl(segment->flags) & OPT_WORDS_MASK) >>
+                      OPT_WORDS_SHIFT) * 4;
   if (data_len > 0 && segment->data != NULL) {
     char *payload = (char *)((uint8_t *) tcp_hdr + TCP_HDR_SIZE);
     memcpy(payload, segment->data, data_len);
+    if (opt_len <= data_len)
+      translate_sack((uint8_t *) payload, opt_len, dst->their_init_seqno);
   }
 
   /* TCP header. Convert relative sequence numbers to sequence numbers. */
@@ -384,7 +669,10 @@ char *convert_to_datagram(conn_t *dst, ctcp_segment_t *segment, int len) {
   tcp_hdr->th_dport = htons(dst->port);
   tcp_hdr->th_seq = htonl(ntohl(segment->seqno) + dst->init_seqno);
   tcp_hdr->th_ack = htonl(ntohl(segment->ackno) + dst->their_init_seqno);
-  tcp_hdr->th_off = TCP_HDR_SIZE / 4;
+  /* Options sit at the start of the cTCP data, which is exactly where they
+     go in a TCP segment. Only the data offset needs to account for them. */
+  tcp_hdr->th_off = TCP_HDR_SIZE / 4 +
+    ((ntohl(segment->flags) & OPT_WORDS_MASK) >> OPT_WORDS_SHIFT);
   tcp_hdr->th_flags = segment->flags;
 
   /* Need to add ACK to all segments if sending it to the web. */
@@ -448,24 +736,15 @@ int recv_filter(int sockfd, void *buf, size_t len, int flags, conn_t **rconn) {
     return r;
 
   /* Some other packet from somewhere where we've already established a
-     connection. Must have the correct source IP, port, and a sequence
-     number we expect. */
-  conn_t *conn = get_connections();
-  while (conn != NULL) {
-    if (conn->port == ntohs(tcp_hdr->th_sport) &&
-        (unix_socket || (!unix_socket && conn->ip_addr == ip_hdr->saddr)) &&
-        ntohl(tcp_hdr->th_seq) >= conn->their_init_seqno &&
-        ntohl(tcp_hdr->th_ack) >= conn->init_seqno) {
-      /* Return associated connection. */
-      if (rconn != NULL)
-        *rconn = conn;
-
-      return r;
-    }
-    conn = conn->next;
-  }
+     connection. */
+  conn_t *conn = conn_lookup(ip_hdr, tcp_hdr);
+  if (conn == NULL)
+    return 0;
 
-  return 0;
+  /* Return associated connection. */
+  if (rconn != NULL)
+    *rconn = conn;
+  return r;
 }
 
 /**
@@ -549,7 +828,8 @@ void *send_resets(void *args) {
  */
 int send_tcp_conn_seg(conn_t *dst, int flags) {
   char *tcp_pkt = create_tcp_seg(dst, flags, NULL, 0);
-  int r = send_pkt(dst, config->socket, tcp_pkt, FULL_HDR_SIZE, 0);
+  int r = send_pkt(dst, config->socket, tcp_pkt,
+                   ntohs(((iphdr_t *) tcp_pkt)->tot_len), 0);
   free(tcp_pkt);
 
   if (r < 0) {
@@ -575,45 +855,151 @@ inline int send_synack(conn_t *dst) {
 ////////////////////// CONNECTIONS AND SENDING/RECEIVING //////////////////////
 
 /**
- * Add to the conn_t list.
+ * Gets the bucket of the connection table for a peer. The IP address is left
+ * out over Unix sockets, where only the port tells peers apart.
  *
- * conn_list: Pointer to linked list of conn_t objects.
- * conn: The new conn_t to add.
+ * ip_addr: IP address of the peer.
+ * port: Port of the peer, in host order.
+ * returns: Index of the bucket.
  */
-void conn_add(conn_t *conn) {
-  conn_t *conn_list = get_connections();
+uint32_t conn_hash(in_addr_t ip_addr, int port) {
+  uint32_t key = (unix_socket ? 0 : (uint32_t) ip_addr) ^ (uint32_t) port;
+  return (key * 2654435761u) >> (32 - conn_table_bits);
+}
 
-  if (conn != conn_list) {
-    conn->prev = &conn_list;
-    conn->next = conn_list;
+/**
+ * Adds a connection to the connection table, doubling the table first if it
+ * is full.
+ *
+ * conn: The connection.
+ */
+void conn_table_add(conn_t *conn) {
+  if (conn_table == NULL || conn_table_count >= (1 << conn_table_bits)) {
+    conn_t **old = conn_table;
+    int old_size = old == NULL ? 0 : 1 << conn_table_bits;
+    conn_table_bits = old == NULL ? 4 : conn_table_bits + 1;
+    conn_table = calloc(1 << conn_table_bits, sizeof(conn_t *));
+
+    int i;
+    for (i = 0; i < old_size; i++) {
+      conn_t *c = old[i], *next;
+      for (; c != NULL; c = next) {
+        next = c->hash_next;
+        uint32_t h = conn_hash(c->ip_addr, c->port);
+        c->hash_next = conn_table[h];
+        conn_table[h] = c;
+      }
+    }
+    free(old);
+  }
 
-    if (conn_list)
-      conn_list->prev = &conn->next;
+  uint32_t h = conn_hash(conn->ip_addr, conn->port);
+  conn->hash_next = conn_table[h];
+  conn_table[h] = conn;
+  conn_table_count++;
+}
+
+/**
+ * Removes a connection from the connection table.
+ *
+ * conn: The connection.
+ */
+void conn_table_remove(conn_t *conn) {
+  conn_t **c = &conn_table[conn_hash(conn->ip_addr, conn->port)];
+  while (*c != NULL && *c != conn)
+    c = &(*c)->hash_next;
+  if (*c != NULL) {
+    *c = conn->hash_next;
+    conn_table_count--;
   }
-  conn->out_queue_tail = &conn->out_queue;
+  if (last_conn == conn)
+    last_conn = NULL;
+}
 
-  if (SERVER)
-    config->connections = conn;
-  else
-    config->sconn = conn;
+/**
+ * Checks whether a packet belongs to a connection: it must have the
+ * connection's source IP and port, and sequence numbers we expect.
+ */
+bool conn_matches(conn_t *conn, iphdr_t *ip_hdr, tcphdr_t *tcp_hdr) {
+  return conn->port == ntohs(tcp_hdr->th_sport) &&
+         (unix_socket || conn->ip_addr == ip_hdr->saddr) &&
+         ntohl(tcp_hdr->th_seq) >= conn->their_init_seqno &&
+         ntohl(tcp_hdr->th_ack) >= conn->init_seqno;
+}
+
+/**
+ * Finds the connection a packet is for, trying the one the last packet was
+ * for before the connection table.
+ *
+ * ip_hdr: IP header of the packet.
+ * tcp_hdr: TCP header of the packet.
+ * returns: The connection, or NULL if there is none.
+ */
+conn_t *conn_lookup(iphdr_t *ip_hdr, tcphdr_t *tcp_hdr) {
+  if (last_conn != NULL && conn_matches(last_conn, ip_hdr, tcp_hdr))
+    return last_conn;
+  if (conn_table == NULL)
+    return NULL;
+
+  conn_t *conn = conn_table[conn_hash(ip_hdr->saddr,
+                                      ntohs(tcp_hdr->th_sport))];
+  for (; conn != NULL; conn = conn->hash_next) {
+    if (conn_matches(conn, ip_hdr, tcp_hdr)) {
+      last_conn = conn;
+      return conn;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Add to the conn_t list and the connection table. The connection's address
+ * and port must already be set up.
+ *
+ * conn: The new conn_t to add.
+ */
+void conn_add(conn_t *conn) {
+  conn_t **conn_list = SERVER ? &config->connections : &config->sconn;
+
+  conn->prev = conn_list;
+  conn->next = *conn_list;
+  if (*conn_list)
+    (*conn_list)->prev = &conn->next;
+  *conn_list = conn;
+
+  conn_table_add(conn);
 }
 
 /**
  * Checks how much space is available in STDOUT for output. conn_output can
- * only write as many bytes as reported by conn_bufspace.
+ * only write as many bytes as reported by conn_bufspace. Once the output
+ * buffer has filled up, there is none until it drains to the low watermark.
  *
  * conn: The connection object.
  * returns: The number of bytes that can be written out.
  */
 size_t conn_bufspace(conn_t *conn) {
-  chunk_t *chunk;
-  size_t used = 0;
+  if (conn->out_full)
+    return 0;
+  return conn->out_size - conn->out_len;
+}
 
-  /* Count up how much output space already used. */
-  for (chunk = conn->out_queue; chunk; chunk = chunk->next) {
-    used += (chunk->size - chunk->used);
+/**
+ * Has the event loop drain the connection's output queue once there is room
+ * for more: in the program's input if running one, otherwise in STDOUT. A
+ * program's input is only polled while output waits for it, since the pipe
+ * reports an error on every poll once the program has exited.
+ *
+ * conn: Associated connection object.
+ */
+void wait_for_output(conn_t *conn) {
+  if (run_program) {
+    conn->poll_in->fd = conn->stdin;
+    conn->poll_in->events = POLLOUT;
+  }
+  else {
+    events[STDOUT_FILENO].events |= POLLOUT;
   }
-  return used > MAX_BUF_SPACE ? 0 : MAX_BUF_SPACE - used;
 }
 
 /**
@@ -622,52 +1008,50 @@ size_t conn_bufspace(conn_t *conn) {
  * conn: Associated connection object.
  */
 void conn_drain(conn_t *conn) {
-  chunk_t *chunk;
   int w;
   bool outputted = false;
-  events[STDOUT_FILENO].events &= ~POLLOUT;
+  if (run_program)
+    conn->poll_in->fd = -1;
+  else
+    events[STDOUT_FILENO].events &= ~POLLOUT;
 
   /* Already wrote an error, can't write anymore. */
   if (conn->wrote_err)
     return;
 
-  /* Drain the output queue. Output as many chunks as possible. */
-  while ((chunk = conn->out_queue)) {
+  /* Drain the output ring, at most two writes: up to its end, then from its
+     start. */
+  while (conn->out_len > 0) {
+    size_t len = conn->out_size - conn->out_start;
+    if (len > conn->out_len)
+      len = conn->out_len;
     if (run_program)
-      w = write(conn->stdin, chunk->buf + chunk->used,
-                chunk->size - chunk->used);
+      w = write(conn->stdin, conn->out_buf + conn->out_start, len);
     else
-      w = write(STDOUT_FILENO, chunk->buf + chunk->used,
-                chunk->size - chunk->used);
+      w = write(STDOUT_FILENO, conn->out_buf + conn->out_start, len);
 
     if (w < 0) {
       if (errno != EAGAIN)
         conn->wrote_err = true;
+      else
+        wait_for_output(conn);
       break;
     }
     outputted = true;
-    chunk->used += w;
+    conn->out_start = (conn->out_start + w) % conn->out_size;
+    conn->out_len -= w;
 
-    /* Could not complete one chunk. Stop after this. */
-    if (chunk->used < chunk->size) {
-      events[STDOUT_FILENO].events |= POLLOUT;
+    /* Could not write it all. Stop after this. */
+    if ((size_t) w < len) {
+      wait_for_output(conn);
       break;
     }
-    conn->out_queue = chunk->next;
-
-    /* Update pointers. */
-    if (!conn->out_queue)
-      conn->out_queue_tail = &conn->out_queue;
-    free(chunk);
   }
-
-  /* Error in outputting if already wrote EOF but still stuff in the output
-     queue. */
-  if (conn->wrote_eof && !conn->wrote_err && !conn->out_queue)
-    conn->wrote_err = true;
+  if (conn->out_full && conn->out_len <= OUT_LOW_WATERMARK(conn->out_size))
+    conn->out_full = false;
 
   /* Output queue has space. Call student code. */
-  if (outputted && !conn->delete_me)
+  if (outputted && !conn->out_full && !conn->delete_me)
     ctcp_output(conn->state);
 }
 
@@ -677,32 +1061,37 @@ void conn_drain(conn_t *conn) {
  * conn: The conn_t to free.
  */
 void conn_free(conn_t *conn) {
-  /* Free up chunks. */
-  chunk_t *chunk, *next_chunk;
-  for (chunk = conn->out_queue; chunk; chunk = next_chunk) {
-    next_chunk = chunk->next;
-    free(chunk);
-  }
+  fprintf(stderr, "[INFO] Segment pool: %u hits, %u misses\n",
+          conn->pool.hits, conn->pool.misses);
 
   /* Adjust pointers. */
   if (conn->next)
     conn->next->prev = conn->prev;
-  if (conn->prev)
-    *conn->prev = conn->next;
-
-  if (conn == get_connections()) {
-    if (SERVER)
-      config->connections = NULL;
-    else
-      config->sconn = NULL;
-  }
+  *conn->prev = conn->next;
+  conn_table_remove(conn);
+  if (SERVER)
+    num_connected--;
 
   /* Close pipes to program, if it's running. */
   if (run_program) {
     close(conn->stdin);
     close(conn->stdout);
   }
-  free(conn);
+
+  /* Stop polling the program. The last pair of slots moves into its place. */
+  if (conn->poll_fd != NULL) {
+    int slot = (conn->poll_fd - events - NUM_POLL) / 2;
+    num_polled--;
+    *conn->poll_fd = events[NUM_POLL + 2 * num_polled];
+    *conn->poll_in = events[NUM_POLL + 2 * num_polled + 1];
+    polled_conns[slot] = polled_conns[num_polled];
+    polled_conns[slot]->poll_fd = conn->poll_fd;
+    polled_conns[slot]->poll_in = conn->poll_in;
+  }
+
+  /* Releases the conn_t and everything else of the connection, output still
+     queued included. */
+  arena_destroy(conn->arena);
 }
 
 /**
@@ -760,6 +1149,17 @@ int conn_input(conn_t *conn, void *buf, size_t len) { ASSERT_CONN;
   return r;
 }
 
+/**
+ * Stops or resumes polling for a connection's input, the program's output if
+ * running one and STDIN otherwise. See poll_input().
+ *
+ * conn: The connection object.
+ * hold: Whether to stop (true) or resume (false) polling.
+ */
+void conn_hold_input(conn_t *conn, bool hold) { ASSERT_CONN;
+  conn->input_held = hold;
+}
+
 /**
  * Schedules a connection object for removal.
  *
@@ -775,6 +1175,36 @@ void conn_remove(conn_t *conn) {
   }
 }
 
+/**
+ * Asks for ctcp_wakeup() to be called once the given time has come.
+ *
+ * conn: The connection object.
+ * when: The time, in microseconds. 0 cancels it.
+ */
+void conn_wakeup(conn_t *conn, long when) { ASSERT_CONN;
+  conn->wakeup_at = when;
+}
+
+/**
+ * Gets a connection's segment buffer pool.
+ *
+ * conn: The connection object.
+ * returns: The pool.
+ */
+ctcp_pool_t *conn_pool(conn_t *conn) {
+  return &conn->pool;
+}
+
+/**
+ * Gets a connection's memory arena.
+ *
+ * conn: The connection object.
+ * returns: The arena.
+ */
+ctcp_arena_t *conn_arena(conn_t *conn) {
+  return conn->arena;
+}
+
 /**
  * Sends a cTCP segment to a destination associated with the provided
  * connection object.
@@ -794,7 +1224,7 @@ int conn_send(conn_t *conn, ctcp_segment_t *segment, size_t len) { ASSERT_CONN;
   }
 
   /* Make a copy of the segment first. */
-  ctcp_segment_t *segment_copy = calloc(len, 1);
+  ctcp_segment_t *segment_copy = pool_alloc(&conn->pool, len);
   memcpy(segment_copy, segment, len);
 
   /* Fork process off in order to do unreliability. Keep track of whether we
@@ -811,7 +1241,7 @@ int conn_send(conn_t *conn, ctcp_segment_t *segment, size_t len) { ASSERT_CONN;
       fprintf(stderr, "[DEBUG] Dropping segment\n");
       print_hdr_ctcp(segment_copy);
     }
-    free(segment_copy);
+    pool_free(&conn->pool, segment_copy);
     return len;
   }
 
@@ -848,7 +1278,7 @@ int conn_send(conn_t *conn, ctcp_segment_t *segment, size_t len) { ASSERT_CONN;
     }
     /* Original process. */
     else {
-      free(segment_copy);
+      pool_free(&conn->pool, segment_copy);
       return len;
     }
   }
@@ -886,8 +1316,8 @@ int conn_send(conn_t *conn, ctcp_segment_t *segment, size_t len) { ASSERT_CONN;
     fprintf(stderr, "[DEBUG] Sent segment\n");
     print_hdr_ctcp(segment_copy);
   }
-  free(pkt);
-  free(segment_copy);
+  pool_free(&conn->pool, pkt);
+  pool_free(&conn->pool, segment_copy);
 
   /* Kill forked process. */
   if (am_i_forked)
@@ -935,7 +1365,7 @@ int conn_output(conn_t *conn, const char *buf, size_t len) { ASSERT_CONN;
 
   /* Nothing in the output queue. Output immediately to the appropriate
      interface. */
-  if (!conn->out_queue) {
+  if (conn->out_len == 0) {
     if (run_program)
       w = write(conn->stdin, buf, len);
     else
@@ -956,26 +1386,27 @@ int conn_output(conn_t *conn, const char *buf, size_t len) { ASSERT_CONN;
     }
   }
 
-  /* Put the rest in an output queue. */
+  /* Put as much of the rest as fits in the output ring. */
+  size_t room = conn->out_size - conn->out_len;
+  if ((size_t) left > room) {
+    len -= left - room;
+    left = room;
+  }
   if (left > 0) {
-    chunk_t *chunk = calloc(offsetof(chunk_t, buf[left]), 1);
-    chunk->next = NULL;
-    chunk->size = left;
-    chunk->used = 0;
-    memcpy(chunk->buf, buf, left);
-
-    /* Update pointers. */
-    *conn->out_queue_tail = chunk;
-    conn->out_queue_tail = &chunk->next;
+    size_t end = (conn->out_start + conn->out_len) % conn->out_size;
+    size_t first = conn->out_size - end;
+    if (first > (size_t) left)
+      first = left;
+    memcpy(conn->out_buf + end, buf, first);
+    memcpy(conn->out_buf, buf + first, left - first);
+    conn->out_len += left;
+    if (conn->out_len >= OUT_HIGH_WATERMARK(conn->out_size))
+      conn->out_full = true;
   }
 
-  /* If there is stuff in the queue, create an event. */
-  if (conn->out_queue) {
-    if (run_program)
-      events[conn->stdin].events |= POLLOUT;
-    else
-      events[STDOUT_FILENO].events |= POLLOUT;
-  }
+  /* If there is stuff in the queue, drain it once there is room for more. */
+  if (conn->out_len > 0)
+    wait_for_output(conn);
   return len;
 }
 
@@ -988,6 +1419,7 @@ int conn_output(conn_t *conn, const char *buf, size_t len) { ASSERT_CONN;
  */
 conn_t *tcp_handshake(void) { ASSERT_CLIENT_ONLY;
   char buf[MAX_PACKET_SIZE];
+  conn_init_buffers(config->sconn);
 
   /* Send a SYN segment to the server. */
   if (send_syn(config->sconn))
@@ -1000,8 +1432,8 @@ conn_t *tcp_handshake(void) { ASSERT_CLIENT_ONLY;
 
   tcphdr_t *synack = (tcphdr_t *) (buf + IP_HDR_SIZE);
 
-  /* Set window size for the other host. */
-  ctcp_cfg->send_window = ntohs(synack->window);
+  /* Set window size, MSS and window scaling for the other host. */
+  apply_syn_options(config->sconn, ctcp_cfg, synack, r - IP_HDR_SIZE);
 
   /* If an ACK is received instead of a SYN-ACK, continue previous
      connection. Get sequence numbers from previous connection. */
@@ -1045,19 +1477,29 @@ conn_t *tcp_new_connection(char *pkt) { ASSERT_SERVER_ONLY;
   tcphdr_t *syn = (tcphdr_t *) (pkt + IP_HDR_SIZE);
 
   /* Set up connection details and add to list of connections. */
-  conn_t *conn = calloc(sizeof(conn_t), 1);
+  conn_t *conn = conn_create();
   conn_setup(conn, ntohl(ip_hdr->saddr), ntohs(syn->th_sport), unix_socket);
+  conn_init_buffers(conn);
   conn->their_init_seqno = ntohl(syn->th_seq);
   conn->ackno = conn->their_init_seqno + 1;
   conn_add(conn);
 
-  /* Send a SYN-ACK to the client. */
-  send_synack(conn);
-
-  /* Get window size of the client. */
-  ctcp_cfg->send_window = ntohs(syn->window);
+  /* Get window size, MSS and window scaling of the client. Window scaling is
+     only used if the client offered it, in which case it is offered back. */
   ctcp_config_t *config_copy = calloc(sizeof(ctcp_config_t), 1);
   memcpy(config_copy, ctcp_cfg, sizeof(ctcp_config_t));
+  apply_syn_options(conn, config_copy, syn,
+                    ntohs(ip_hdr->tot_len) - IP_HDR_SIZE);
+
+  /* The client may have a weight of its own. */
+  int i;
+  for (i = 0; i < num_client_weights; i++) {
+    if (client_weights[i].port == conn->port)
+      config_copy->weight = client_weights[i].weight;
+  }
+
+  /* Send a SYN-ACK to the client. */
+  send_synack(conn);
 
   /* Student code. */
   ctcp_state_t *state = ctcp_init(conn, config_copy);
@@ -1110,13 +1552,20 @@ void execute_program(conn_t *conn) { ASSERT_SERVER_ONLY;
     conn->stdin = PARENT_WRITE_FD;
     conn->stdout = PARENT_READ_FD;
 
-    /* Start polling the stdout. */
-    int id = NUM_POLL + num_connected - 1;
-    struct pollfd *stdout = &events[id];
+    /* Start polling the stdout. The stdin is only polled when output is
+       waiting for room in it, and must not block the event loop when the
+       program stops reading. */
+    polled_conns[num_polled] = conn;
+    struct pollfd *stdout = &events[NUM_POLL + 2 * num_polled];
+    struct pollfd *stdin = stdout + 1;
+    num_polled++;
     stdout->fd = conn->stdout;
     async(stdout->fd);
     stdout->events = POLLIN | POLLHUP;
     conn->poll_fd = stdout;
+    stdin->fd = -1;
+    async(conn->stdin);
+    conn->poll_in = stdin;
   }
 }
 
@@ -1128,33 +1577,103 @@ void delete_all_connections() {
   conn_t *conn, *next;
   for (conn = get_connections(); conn != NULL; conn = next) {
     next = conn->next;
-    if (conn->delete_me)
+    /* Output already accepted is written out first, unless it can't be. */
+    if (conn->delete_me && (conn->out_len == 0 || conn->wrote_err))
       conn_free(conn);
   }
 }
 
+/**
+ * Works out how long to wait for events: until the next call to ctcp_timer()
+ * or the earliest wakeup asked for with conn_wakeup(), whichever comes first.
+ * Wakeups are kept to the microsecond.
+ *
+ * ts: Set to how long to wait.
+ */
+void poll_timeout(struct timespec *ts) {
+  long now = current_time_us();
+  long wait = need_timer_in(&last_timeout, ctcp_cfg->timer) * 1000;
+  conn_t *conn;
+
+  for (conn = get_connections(); conn; conn = conn->next) {
+    if (conn->wakeup_at == 0 || conn->delete_me)
+      continue;
+    if (conn->wakeup_at - now < wait)
+      wait = conn->wakeup_at > now ? conn->wakeup_at - now : 0;
+  }
+  ts->tv_sec = wait / 1000000;
+  ts->tv_nsec = (wait % 1000000) * 1000;
+}
+
+/**
+ * Calls ctcp_wakeup() for every connection whose wakeup time has come.
+ */
+void run_wakeups() {
+  long now = current_time_us();
+  conn_t *conn;
+
+  for (conn = get_connections(); conn; conn = conn->next) {
+    if (conn->wakeup_at == 0 || conn->wakeup_at > now || conn->delete_me)
+      continue;
+    conn->wakeup_at = 0;
+    ctcp_wakeup(conn->state);
+  }
+}
+
+/**
+ * Polls for input only where a connection can take it: not once it has read
+ * EOF, nor while it holds its input (see conn_hold_input()). Input left ready
+ * would keep ppoll() from ever sleeping. STDIN goes to the most recently
+ * connected client, and is not read at all when running programs.
+ */
+void poll_input() {
+  conn_t *conn = get_connections();
+
+  events[STDIN_FILENO].fd = !run_program && conn != NULL &&
+                            !conn->input_held && !conn->read_eof ?
+                            STDIN_FILENO : -1;
+  if (!run_program)
+    return;
+  for (; conn; conn = conn->next) {
+    conn->poll_fd->fd = conn->input_held || conn->read_eof ?
+                        -1 : conn->stdout;
+  }
+}
+
 /**
  * Main loop. Handles the following:
  *   - Input from STDIN.
  *   - Messages from programs.
  *   - Packets from the socket.
- *   - Timeouts.
+ *   - Timeouts and wakeups.
+ *   - Turns for connections with data to send.
  */
 void do_loop() {
   char buf[MAX_PACKET_SIZE];
+  size_t buf_size = local_packet_size();
   conn_t *conn = NULL;
+  struct timespec timeout;
+  bool busy = false;
 
   while (true) {
-    memset(buf, 0, MAX_PACKET_SIZE);
-    poll(events, NUM_POLL + num_connected,
-         need_timer_in(&last_timeout, ctcp_cfg->timer));
+    memset(buf, 0, buf_size);
+    poll_timeout(&timeout);
+    poll_input();
+
+    /* Connections are still waiting for their turn. Only pick up whatever
+       events are already there. */
+    if (busy) {
+      timeout.tv_sec = 0;
+      timeout.tv_nsec = 0;
+    }
+    ppoll(events, NUM_POLL + 2 * num_polled, &timeout, NULL);
 
     /* Input from stdin. Server will only send to most-recently connected
        client. */
     if (!run_program && events[STDIN_FILENO].revents & POLLIN) {
       conn = get_connections();
 
-      if (conn != NULL)
+      if (conn != NULL && !conn->delete_me)
         ctcp_read(conn->state);
     }
 
@@ -1166,65 +1685,86 @@ void do_loop() {
     }
 
     /* Poll for output received from running programs. Send to client
-       client associated with this program instance. */
+       client associated with this program instance. Output waiting for room
+       in a program's input goes on once there is some. */
     if (run_program) {
       conn = get_connections();
       while (conn != NULL) {
-        if (conn->poll_fd->revents & POLLIN) {
+        if ((conn->poll_fd->revents & POLLIN) && !conn->delete_me) {
           ctcp_read(conn->state);
         }
+        if (conn->poll_in->revents & (POLLOUT | POLLHUP | POLLERR))
+          conn_drain(conn);
         conn = conn->next;
       }
     }
 
-    /* Receive packet on socket from other hosts. Ignore packets if they are
-       not large enough or not for us. */
+    /* Receive packets on socket from other hosts. Ignore packets if they
+       are not large enough or not for us. Take whatever has queued up before
+       connections get their turns, so an ACK that opens a window a segment
+       at a time does not decide who sends next. */
     if (events[2].revents & POLLIN) {
-      conn = NULL;
-      int len = recv_filter(config->socket, buf, MAX_PACKET_SIZE, 0, &conn);
-      if (len >= FULL_HDR_SIZE) {
-        tcphdr_t *tcp_hdr = (tcphdr_t *) (buf + IP_HDR_SIZE);
-
-        /* Packet from an established connection. Pass to student code. */
-        if (conn != NULL) {
-          ctcp_segment_t *segment = convert_to_ctcp(conn, buf, len);
-          len = len - FULL_HDR_SIZE + sizeof(ctcp_segment_t);
-
-          /* Don't log or forward to student code if it's an ACK from a new
-             connection. */
-          if (tcp_hdr->th_sport == new_connection &&
-              (segment->flags & TH_ACK) &&
-              ntohl(segment->seqno) == 1 && ntohl(segment->ackno) == 1) {
-            new_connection = 0;
-            free(segment);
-          }
-          else {
-            if (log_file != -1 || test_debug_on) {
-              log_segment(log_file, config->ip_addr, config->port, conn,
-                          segment, len, false, unix_socket);
+      int n;
+      for (n = 0; n < RECV_BATCH; n++) {
+        conn = NULL;
+        int len = recv_filter(config->socket, buf, buf_size,
+                              n > 0 ? MSG_DONTWAIT : 0, &conn);
+        if (len < 0)
+          break;
+        if (len >= FULL_HDR_SIZE) {
+          tcphdr_t *tcp_hdr = (tcphdr_t *) (buf + IP_HDR_SIZE);
+
+          /* Packet from an established connection. Pass to student code. */
+          if (conn != NULL) {
+            ctcp_segment_t *segment = convert_to_ctcp(conn, buf, len);
+            len = len - FULL_HDR_SIZE + sizeof(ctcp_segment_t);
+
+            /* Drop it if the connection is only still around to finish its
+               output. */
+            if (conn->delete_me) {
+              pool_free(&conn->pool, segment);
+            }
+
+            /* Don't log or forward to student code if it's an ACK from a new
+               connection. */
+            else if (tcp_hdr->th_sport == new_connection &&
+                (segment->flags & TH_ACK) &&
+                ntohl(segment->seqno) == 1 && ntohl(segment->ackno) == 1) {
+              new_connection = 0;
+              pool_free(&conn->pool, segment);
+            }
+            else {
+              if (log_file != -1 || test_debug_on) {
+                log_segment(log_file, config->ip_addr, config->port, conn,
+                            segment, len, false, unix_socket);
+              }
+              ctcp_receive(conn->state, segment, len);
             }
-            ctcp_receive(conn->state, segment, len);
           }
-        }
 
-        /* New connection. */
-        else if (tcp_hdr->th_flags & TH_SYN) {
-          conn_t *conn = tcp_new_connection(buf);
+          /* New connection. */
+          else if (tcp_hdr->th_flags & TH_SYN) {
+            conn_t *conn = tcp_new_connection(buf);
 
-          /* Start a new program associated with this client. */
-          if (run_program && conn)
-            execute_program(conn);
-          new_connection = tcp_hdr->th_sport;
+            /* Start a new program associated with this client. */
+            if (run_program && conn)
+              execute_program(conn);
+            new_connection = tcp_hdr->th_sport;
+          }
         }
       }
     }
 
+    run_wakeups();
+
     /* Check if timer is up. */
     if (need_timer_in(&last_timeout, ctcp_cfg->timer) == 0) {
       ctcp_timer();
       get_time(&last_timeout);
     }
 
+    busy = ctcp_schedule();
+
     /* Delete connections if needed. */
     delete_all_connections();
   }
@@ -1240,9 +1780,10 @@ void setup_poll() {
   stdin->events = POLLIN | POLLHUP | POLLERR;
   async(STDIN_FILENO);
 
-  /* Poll stdout to do asynchronous output.. */
+  /* Poll stdout to do asynchronous output.. Output goes to the programs
+     instead when running them, so it is not polled at all. */
   struct pollfd *stdout = &events[STDOUT_FILENO];
-  stdout->fd = STDOUT_FILENO;
+  stdout->fd = run_program ? -1 : STDOUT_FILENO;
   stdout->events = POLLOUT | POLLERR;
   async(STDOUT_FILENO);
 
@@ -1266,6 +1807,14 @@ void end_client() {
     return;
   }
 
+  /* Write out whatever output is still queued before exiting. */
+  conn_t *conn = get_connections();
+  if (conn != NULL && conn->out_len > 0) {
+    fcntl(STDOUT_FILENO, F_SETFL,
+          fcntl(STDOUT_FILENO, F_GETFL) & ~O_NONBLOCK);
+    conn_drain(conn);
+  }
+
   delete_all_connections();
   close(config->socket);
   fprintf(stderr, "[INFO] Disconnected from server\n");
@@ -1324,6 +1873,32 @@ int start_server(char *port, int argc, char *argv[]) {
   return 0;
 }
 
+/**
+ * Parses a --weight argument: a weight for all connections, or port:weight
+ * for the client on that port.
+ *
+ * arg: The argument.
+ * weight: Set to the weight for all connections, if that is what it is.
+ * returns: 0 on success, -1 if the argument is invalid.
+ */
+int parse_weight(char *arg, int *weight) {
+  char *colon = strchr(arg, ':');
+  int w = atoi(colon != NULL ? colon + 1 : arg);
+  if (w < 1 || w > MAX_WEIGHT)
+    return -1;
+
+  if (colon == NULL) {
+    *weight = w;
+    return 0;
+  }
+  if (atoi(arg) <= 0 || num_client_weights == MAX_CLIENT_WEIGHTS)
+    return -1;
+  client_weights[num_client_weights].port = atoi(arg);
+  client_weights[num_client_weights].weight = w;
+  num_client_weights++;
+  return 0;
+}
+
 /**
  * Prints out a usage message.
  *
@@ -1337,6 +1912,17 @@ static void usage(char *progname) {
     "   -p port\n"
     "   [-d]\n"
     "   [-w window_size]\n"
+    "   [--max-window window_size]\n"
+    "   [--mss unix_segment_size]\n"
+    "   [--cc newreno|cubic|bbr]\n"
+    "   [--sack]\n"
+    "   [--timestamps]\n"
+    "   [--delack delayed_ack_ms]\n"
+    "   [--coalesce nodelay|nagle|cork]\n"
+    "   [--pace]\n"
+    "   [--max-rate kilobytes_per_second]\n"
+    "   [--weight [client_port:]weight]\n"
+    "   [--output-buffer bytes]\n"
     "   [--seed seed]\n"
     "   [--drop drop_percent]\n"
     "   [--corrupt corrupt_percent]\n"
@@ -1363,6 +1949,13 @@ int main(int argc , char *argv[]) {
   char *port_str = NULL;
   int port = -1;
   int window = 1;
+  int max_window = MAX_WINDOW_SEGMENTS;
+  int cc_algorithm = CC_NEWRENO;
+  int delayed_ack = DELAYED_ACK_INTERVAL;
+  int send_policy = SEND_NODELAY;
+  bool pacing = false;
+  uint32_t max_pacing_rate = 0;
+  int weight = 1;
   seed = time(NULL);
   test_debug_on = false;
   lab5_mode = false;
@@ -1373,6 +1966,17 @@ int main(int argc , char *argv[]) {
     { "client", required_argument, NULL, 'c' },
     { "port", required_argument, NULL, 'p' },
     { "window", required_argument, NULL, 'w' },
+    { "max-window", required_argument, NULL, 'm' },
+    { "mss", required_argument, NULL, 'x' },
+    { "cc", required_argument, NULL, 'g' },
+    { "sack", no_argument, NULL, 'k' },
+    { "timestamps", no_argument, NULL, 'i' },
+    { "delack", required_argument, NULL, 'a' },
+    { "coalesce", required_argument, NULL, 'o' },
+    { "pace", no_argument, NULL, 'v' },
+    { "max-rate", required_argument, NULL, 'b' },
+    { "weight", required_argument, NULL, 'u' },
+    { "output-buffer", required_argument, NULL, 'n' },
 
     { "seed", required_argument, NULL, 'e'},
     { "drop", required_argument, NULL, 'r' },
@@ -1410,6 +2014,73 @@ int main(int argc , char *argv[]) {
     case 'w':
       window = atoi(optarg);
       break;
+    /* Largest window receive-window autotuning may grow to. */
+    case 'm':
+      max_window = atoi(optarg);
+      break;
+    /* Segment data size over Unix sockets. */
+    case 'x':
+      unix_mss = atoi(optarg);
+      if (unix_mss <= 0)
+        usage(progname);
+      if (unix_mss > MAX_UNIX_SEG_DATA_SIZE)
+        unix_mss = MAX_UNIX_SEG_DATA_SIZE;
+      break;
+    /* Congestion control algorithm. */
+    case 'g':
+      cc_algorithm = cc_lookup(optarg);
+      if (cc_algorithm < 0) {
+        fprintf(stderr, "[ERROR] Unknown congestion control %s\n", optarg);
+        usage(progname);
+      }
+      break;
+    /* Selective acknowledgements. */
+    case 'k':
+      offer_sack = true;
+      break;
+    /* Timestamp options. */
+    case 'i':
+      offer_timestamps = true;
+      break;
+    /* Delayed-ACK timeout. */
+    case 'a':
+      delayed_ack = atoi(optarg);
+      break;
+    /* Send policy for data smaller than a segment. */
+    case 'o':
+      if (strcmp(optarg, "nodelay") == 0)
+        send_policy = SEND_NODELAY;
+      else if (strcmp(optarg, "nagle") == 0)
+        send_policy = SEND_NAGLE;
+      else if (strcmp(optarg, "cork") == 0)
+        send_policy = SEND_CORK;
+      else {
+        fprintf(stderr, "[ERROR] Unknown send policy %s\n", optarg);
+        usage(progname);
+      }
+      break;
+    /* Pacing, optionally capped at a rate. */
+    case 'v':
+      pacing = true;
+      break;
+    case 'b':
+      if (atoi(optarg) <= 0)
+        usage(progname);
+      pacing = true;
+      uint64_t max_rate = (uint64_t) atoi(optarg) * 1000;
+      max_pacing_rate = max_rate < UINT32_MAX ? max_rate : UINT32_MAX;
+      break;
+    /* Share of transmit opportunities. */
+    case 'u':
+      if (parse_weight(optarg, &weight) < 0)
+        usage(progname);
+      break;
+    /* Space for buffering output. */
+    case 'n':
+      if (atoi(optarg) <= 0 || atoi(optarg) > MAX_OUT_BUF_SIZE)
+        usage(progname);
+      out_buf_size = atoi(optarg);
+      break;
     /* Seed for unreliability. */
     case 'e':
       seed = atoi(optarg);
@@ -1471,20 +2142,34 @@ int main(int argc , char *argv[]) {
 
   /* Global configuration. */
   struct config cc;
+  memset(&cc, 0, sizeof(struct config));
   config = &cc;
 
   /* CTCP config for students. */
   static ctcp_config_t cfg;
   ctcp_cfg = &cfg;
+  if (max_window < window)
+    max_window = window;
+  if (max_window > (UINT16_MAX << TCP_MAX_WINSHIFT) / MAX_SEG_DATA_SIZE)
+    max_window = (UINT16_MAX << TCP_MAX_WINSHIFT) / MAX_SEG_DATA_SIZE;
+  if (window > max_window)
+    window = max_window;
   cfg.recv_window = window * MAX_SEG_DATA_SIZE;
   cfg.send_window = window * MAX_SEG_DATA_SIZE;
+  cfg.max_recv_window = max_window * MAX_SEG_DATA_SIZE;
+  cfg.mss = MAX_SEG_DATA_SIZE;
   cfg.timer = TIMER_INTERVAL;
   cfg.rt_timeout = RT_INTERVAL;
+  cfg.cc_algorithm = cc_algorithm;
+  cfg.delayed_ack = delayed_ack;
+  cfg.send_policy = send_policy;
+  cfg.pacing = pacing;
+  cfg.max_pacing_rate = max_pacing_rate;
+  cfg.weight = weight;
 
   /* Used for polling later. */
-  struct pollfd _events[NUM_POLL + MAX_NUM_CLIENTS];
-  memset(_events, 0, sizeof(struct pollfd) * (NUM_POLL + MAX_NUM_CLIENTS));
-  events = _events;
+  events = calloc(NUM_POLL + 2 * MAX_NUM_CLIENTS, sizeof(struct pollfd));
+  polled_conns = calloc(MAX_NUM_CLIENTS, sizeof(conn_t *));
 
   /* Start client/server. */
   if (is_client) {
@@ -21,8 +21,8 @@
 /** Localhost IP address in_addr_t. */
 #define LOCALHOST 16777343
 
-/** Maximum number of clients that can connect to the server. */
-#define MAX_NUM_CLIENTS 10
+/** Maximum number of clients that can be connected to the server at once. */
+#define MAX_NUM_CLIENTS 16384
 
 /** Default number of things to poll (stdin, stdout, socket). */
 #define NUM_POLL 3
@@ -41,6 +41,24 @@
 /** Timer interval (for calls to ctcp_timer) in milliseconds. */
 #define TIMER_INTERVAL 40
 
+/** Default delayed-ACK timeout in milliseconds. */
+#define DELAYED_ACK_INTERVAL 40
+
+/** Default segment data size over Unix sockets. */
+#define UNIX_SEG_DATA_SIZE 16384
+
+/** Default ceiling for receive-window autotuning, in segments. */
+#define MAX_WINDOW_SEGMENTS 1024
+
+/** Largest --weight a connection may be given. */
+#define MAX_WEIGHT 64
+
+/** Most clients --weight can give a weight of their own. */
+#define MAX_CLIENT_WEIGHTS 64
+
+/** Most packets read off the socket per pass through the event loop. */
+#define RECV_BATCH 64
+
 /** Connection timeout interval in seconds. */
 #define CONN_TIMEOUT 10
 
@@ -61,20 +79,18 @@
 #define CHILD_READ_FD (pipes[PARENT_WRITE_PIPE][READ_FD])
 #define CHILD_WRITE_FD (pipes[PARENT_READ_PIPE][WRITE_FD])
 
-/** Maximum space for buffering STDOUT for a given connection. */
-#define MAX_BUF_SPACE 8192
+/** Default space for buffering STDOUT for a given connection. */
+#define DEFAULT_OUT_BUF_SIZE 8192
+
+/** Largest output buffer --output-buffer accepts. */
+#define MAX_OUT_BUF_SIZE (64 * 1024 * 1024)
 
 /**
- * Chunk of output. Used to do asynchronous output. A connection will store
- * a queue of chunks to be outputted later.
+ * Output watermarks. Once the output buffer fills up to the high watermark,
+ * conn_bufspace() reports no space until it drains down to the low one.
  */
-struct chunk {
-  struct chunk *next;
-  size_t size;              /* Size of chunk, in bytes */
-  size_t used;              /* Amount of chunk already outputted */
-  char buf[1];              /* Data */
-} __attribute__((packed));
-typedef struct chunk chunk_t;
+#define OUT_HIGH_WATERMARK(size) (size)
+#define OUT_LOW_WATERMARK(size) ((size) / 2)
 
 
 /**
@@ -144,8 +160,8 @@ typedef struct tcphdr tcphdr_t;
 #define TCP_HDR_SIZE sizeof(tcphdr_t)
 #define FULL_HDR_SIZE (sizeof(iphdr_t) + sizeof(tcphdr_t))
 
-/** Maximum packet size (data and headers). */
-#define MAX_PACKET_SIZE (1440 + sizeof(iphdr_t) + sizeof(tcphdr_t))
+/** Maximum packet size (data, options and headers). */
+#define MAX_PACKET_SIZE (MAX_UNIX_SEG_DATA_SIZE + MAX_OPT_SIZE + FULL_HDR_SIZE)
 
 /** TCP pseudoheader, used in checksum calculations. */
 struct tcp_pseudoheader {
@@ -183,40 +199,47 @@ bool add_network_line_ending(bool webserver, char *buf, size_t len) {
 /**
  * Computes the TCP checksum. Returns the checksum in network order.
  *
+ * The pseudoheader is exactly as long as the end of the IP header, from the
+ * TTL on. It is written over that part of the packet for the checksum, so
+ * the TCP segment does not have to be copied, and the IP header is put back
+ * afterwards.
+ *
  * packet: IP packet with a TCP payload.
  * len: Length of data (0 if no data and only TCP and IP headers).
  *
  * returns: The checksum in network order.
  */
 uint16_t cksum_tcp(iphdr_t *packet, uint16_t len) {
-  tcphdr_t *tcp_hdr = (tcphdr_t *) ((uint8_t *) packet + IP_HDR_SIZE);
-
-  /* Construct pseudoheader. */
-  tcp_pseudoheader_t *phdr = calloc(TCP_PSEUDOHDR_SIZE + len, 1);
-  phdr->src_addr = packet->saddr;
-  phdr->dst_addr = packet->daddr;
+  size_t phdr_len = TCP_PSEUDOHDR_SIZE - TCP_HDR_SIZE;
+  tcp_pseudoheader_t *phdr = (tcp_pseudoheader_t *)
+    ((uint8_t *) packet + IP_HDR_SIZE - phdr_len);
+  char saved[TCP_PSEUDOHDR_SIZE - TCP_HDR_SIZE];
+  memcpy(saved, phdr, phdr_len);
+
+  uint32_t src_addr = packet->saddr;
+  uint32_t dst_addr = packet->daddr;
+  phdr->src_addr = src_addr;
+  phdr->dst_addr = dst_addr;
+  phdr->placeholder = 0;
   phdr->protocol = IPPROTO_TCP;
   phdr->tcp_len = htons(TCP_HDR_SIZE + len);
-
-  /* Append TCP segment and compute checksum. */
-  memcpy(&(phdr->tcp_hdr), tcp_hdr, TCP_HDR_SIZE + len);
   uint16_t result = cksum(phdr, len + TCP_PSEUDOHDR_SIZE);
-  free(phdr);
+
+  memcpy(phdr, saved, phdr_len);
   return result;
 }
 
 /**
- * Creates an IP packet. The resulting packet must be freed by the caller.
- * Assumes arguments are in network order.
+ * Fills in the IP header of a packet. Assumes arguments are in network order.
  *
+ * datagram: The packet. Its IP header must be zeroed.
  * src_ip: Source IP address.
  * dst_ip: Destination IP address.
  * len: Size of the IP packet payload.
- * returns: An IP packet of the specified length.
  */
-char *create_datagram(in_addr_t src_ip, in_addr_t dst_ip, uint16_t len) {
+void init_datagram(char *datagram, in_addr_t src_ip, in_addr_t dst_ip,
+                   uint16_t len) {
   uint16_t total_len = IP_HDR_SIZE + len;
-  char *datagram = calloc(total_len, 1);
   iphdr_t *ip_hdr = (iphdr_t *) datagram;
 
   /* IP header. */
@@ -234,6 +257,20 @@ char *create_datagram(in_addr_t src_ip, in_addr_t dst_ip, uint16_t len) {
 
   /* IP checksum. */
   ip_hdr->check = cksum(datagram, IP_HDR_SIZE);
+}
+
+/**
+ * Creates an IP packet. The resulting packet must be freed by the caller.
+ * Assumes arguments are in network order.
+ *
+ * src_ip: Source IP address.
+ * dst_ip: Destination IP address.
+ * len: Size of the IP packet payload.
+ * returns: An IP packet of the specified length.
+ */
+char *create_datagram(in_addr_t src_ip, in_addr_t dst_ip, uint16_t len) {
+  char *datagram = calloc(IP_HDR_SIZE + len, 1);
+  init_datagram(datagram, src_ip, dst_ip, len);
   return datagram;
 }
 
@@ -279,33 +316,64 @@ struct conn {
   uint32_t seqno;              /* Current sequence number */
   uint32_t next_seqno;         /* Sequence number of next segment to send */
   uint32_t ackno;              /* Current ack number */
+  bool wscale_ok;              /* Whether both sides offered window scaling */
+  bool sack_ok;                /* Whether both sides offered SACK */
+  bool ts_ok;                  /* Whether both sides offered timestamps */
+  uint32_t ts_recent;          /* Their timestamp, echoed in the handshake */
+  uint8_t rcv_wscale;          /* Shift of the windows I advertise */
+  uint32_t recv_window;        /* My receive window, as the handshake left
+                                  it */
+  long wakeup_at;              /* When to call ctcp_wakeup(), in us, 0 if
+                                  never */
 
   int stdin;                   /* STDIN for the program */
   int stdout;                  /* STDOUT for the program */
   struct pollfd *poll_fd;      /* Used for polling for output from program */
+  struct pollfd *poll_in;      /* Used for polling for room in the program's
+                                  input, when output is waiting for it */
 
   bool read_eof;               /* EOF read from STDIN */
+  bool input_held;             /* Whether input is not polled for, see
+                                  conn_hold_input() */
   bool wrote_eof;              /* EOF wrote to STDOUT */
   bool wrote_err;              /* Error writing to STDOUT */
   bool delete_me;              /* Whether or not to delete this object. */
 
-  chunk_t *out_queue;          /* Queue for output to STDOUT */
-  chunk_t **out_queue_tail;    /* End of the output queue */
+  char *out_buf;               /* Ring of output waiting for STDOUT */
+  size_t out_size;             /* Capacity of out_buf */
+  size_t out_start;            /* Where in out_buf the waiting output starts */
+  size_t out_len;              /* Bytes of output waiting */
+  bool out_full;               /* Whether output reached the high watermark
+                                  and has not drained to the low one yet */
+  ctcp_arena_t *arena;         /* Memory for everything of this connection,
+                                  including the conn_t itself */
+  ctcp_pool_t pool;            /* Buffers for segments, packets and output */
 
   struct conn *next;           /* Linked list of connections */
   struct conn **prev;
+  struct conn *hash_next;      /* Next in its bucket of the connection table */
 };
 typedef struct conn conn_t;
 
 
 /**
- * Add to the conn_t list.
+ * Add to the conn_t list and the connection table. The connection's address
+ * and port must already be set up.
  *
- * conn_list: Pointer to linked list of conn_t objects.
  * conn: The new conn_t to add.
  */
 void conn_add(conn_t *conn);
 
+/**
+ * Finds the connection a packet is for, trying the one the last packet was
+ * for before the connection table.
+ *
+ * ip_hdr: IP header of the packet.
+ * tcp_hdr: TCP header of the packet.
+ * returns: The connection, or NULL if there is none.
+ */
+conn_t *conn_lookup(iphdr_t *ip_hdr, tcphdr_t *tcp_hdr);
+
 /**
  * Set up a conn_t object with the right values.
  *
@@ -339,6 +407,19 @@ void conn_setup(conn_t *conn, in_addr_t ip_addr, int port, bool unix_socket) {
   conn->ackno = 0;
 }
 
+/**
+ * Creates a connection object. It comes from an arena of its own, which
+ * everything else the connection allocates also comes from.
+ *
+ * returns: The zeroed connection object. Release it with conn_free().
+ */
+conn_t *conn_create(void) {
+  ctcp_arena_t *arena = arena_create();
+  conn_t *conn = arena_alloc(arena, sizeof(conn_t));
+  conn->arena = arena;
+  return conn;
+}
+
 /**
  * Gets the client's own IP address.
  *
@@ -404,7 +485,7 @@ in_addr_t ip_from_hostname(char *hostname) {
 
 /////////////////////////////////// LOGGING ////////////////////////////////////
 
-#define LOG_SIZE (4 * MAX_SEG_DATA_SIZE)
+#define LOG_SIZE (4 * MAX_UNIX_SEG_DATA_SIZE)
 #define LOG_ENTRY_SIZE 20
 #define ADDR_FORMAT_STR "%s\t%d\t%s\t%d\t"
 #define LOCALHOST_STR "localhost"
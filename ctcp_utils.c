@@ -22,6 +22,12 @@ long current_time() {
   return tv.tv_sec * 1000 + tv.tv_usec / 1000;
 }
 
+long current_time_us() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
 void print_hdr_ctcp(ctcp_segment_t *segment) {
   fprintf(stderr, "[cTCP] seqno: %d, ackno: %d, len: %d, flags:",
           ntohl(segment->seqno), ntohl(segment->ackno), ntohs(segment->len));
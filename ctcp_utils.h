@@ -27,6 +27,11 @@ uint16_t cksum(const void *_data, uint16_t len);
  */
 long current_time();
 
+/**
+ * Gets the current time in microseconds.
+ */
+long current_time_us();
+
 /**
  * Prints out the headers of a cTCP segment. Expects the segment to come in
  * network-byte order. All fields are converted and printed out in host order,
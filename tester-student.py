@@ -6,6 +6,8 @@ import random
 import signal
 import subprocess
 import sys
+import tempfile
+import threading
 import time
 import traceback
 
@@ -143,22 +145,26 @@ def choose_ports(min_port=1025, max_port=65535):
     return str(client_port), str(server_port)
 
 
-def start_server(port=DEFAULT_SERVER_PORT, flags=[], reference=False):
+def start_server(port=DEFAULT_SERVER_PORT, flags=[], reference=False,
+                 debug=True):
   """
   Function: start_server
   ----------------------
   Starts a cTCP server.
 
   reference: Whether or not to use the reference binary.
+  debug: Whether or not to log segments for the tester. Large transfers turn
+         it off, since nothing reads their logs.
   """
   binary = REFERENCE_BINARY if reference else CTCP_BINARY
-  server = Popen([binary, "-s", "-p", port, "-z"] + flags, stdin=PIPE,
-                 stdout=PIPE, stderr=PIPE)
+  server = Popen([binary, "-s", "-p", port] + (["-z"] if debug else []) +
+                 flags, stdin=PIPE, stdout=PIPE, stderr=PIPE)
   return server
 
 
 def start_client(server="localhost", server_port=DEFAULT_SERVER_PORT, 
-                 port=DEFAULT_CLIENT_PORT, flags=[], reference=False):
+                 port=DEFAULT_CLIENT_PORT, flags=[], reference=False,
+                 debug=True):
   """
   Function: start_client
   ----------------------
@@ -167,10 +173,12 @@ def start_client(server="localhost", server_port=DEFAULT_SERVER_PORT,
   server: Location of server.
   port: Port to start client at.
   reference: Whether or not to use the reference binary.
+  debug: Whether or not to log segments for the tester.
   """
   binary = REFERENCE_BINARY if reference else CTCP_BINARY
-  client = Popen([binary, "-c", server + ":" + server_port, "-p", port, "-z"] +
-                 flags, stdin=PIPE, stdout=PIPE, stderr=PIPE)
+  client = Popen([binary, "-c", server + ":" + server_port, "-p", port] +
+                 (["-z"] if debug else []) + flags, stdin=PIPE, stdout=PIPE,
+                 stderr=PIPE)
   return client
 
 
@@ -289,6 +297,74 @@ def write_to(host, msg):
     pass
 
 
+def read_all_from(host, length, seconds):
+  """
+  Function: read_all_from
+  -----------------------
+  Reads a number of bytes from a host's STDOUT. Gives up after a while.
+
+  host: Host to read from.
+  length: Number of bytes to read.
+  seconds: How long to wait for all of them.
+  returns: What was read.
+  """
+  msg = ""
+  try:
+    with timeout(seconds=seconds):
+      while len(msg) < length:
+        data = os.read(host.stdout.fileno(), length - len(msg))
+        if not data:
+          break
+        msg += data
+  except (OSError, TimeoutError):
+    pass
+  return msg
+
+
+def write_all_to(host, msg):
+  """
+  Function: write_all_to
+  ----------------------
+  Writes a message of any size to the specified host's STDIN from another
+  thread, then closes it. The host may stop reading while its connection
+  waits on the other side.
+
+  host: Host to write to.
+  msg: Message to write.
+  returns: The writing thread.
+  """
+  def write():
+    try:
+      host.stdin.write(msg)
+      host.stdin.close()
+    except IOError:
+      pass
+
+  writer = threading.Thread(target=write)
+  writer.daemon = True
+  writer.start()
+  return writer
+
+
+def wait_for_file(path, size, seconds):
+  """
+  Function: wait_for_file
+  -----------------------
+  Waits for a file to reach a size.
+
+  path: File to wait for.
+  size: Size to wait for, in bytes.
+  seconds: How long to wait.
+  returns: Whether or not the file reached the size in time.
+  """
+  deadline = time.time() + seconds
+  while time.time() < deadline:
+    if os.path.exists(path) and os.path.getsize(path) >= size:
+      return True
+    time.sleep(0.05)
+  return False
+
+
 #################################### TESTS  ####################################
 
 def client_sends():
@@ -636,6 +712,115 @@ def larger_windows():
   return passed
 
 
+def program_stall():
+  """
+  Runs a program per client on the student/server. Client 1's program stops
+  reading while client 1 sends a lot of data. Client 2's data should still
+  reach its program right away, and client 1's once its program reads again.
+  """
+  out_dir = tempfile.mkdtemp()
+  program = 'read f; [ "$f" = slow ] && sleep 8; cat > %s/$f' % out_dir
+  slow_str = os.urandom(2000000)
+  fast_str = os.urandom(20000)
+
+  server_port = choose_ports()[1]
+  slow_port, fast_port = choose_ports()
+  server = start_server(port=server_port, flags=["--", "sh", "-c", program],
+                        debug=False)
+  time.sleep(0.5)
+  slow_client = start_client(server_port=server_port, port=slow_port,
+                             debug=False)
+  write_all_to(slow_client, "slow\n" + slow_str)
+  time.sleep(1)
+
+  # Client 2's data gets through while client 1's program is not reading.
+  fast_client = start_client(server_port=server_port, port=fast_port,
+                             debug=False)
+  write_all_to(fast_client, "fast\n" + fast_str)
+  if not wait_for_file(out_dir + "/fast", len(fast_str), TEST_TIMEOUT):
+    return False
+
+  # Then all of client 1's data once its program reads again.
+  if not wait_for_file(out_dir + "/slow", len(slow_str), 8 + TEST_TIMEOUT):
+    return False
+  return (
+    open(out_dir + "/fast", "rb").read() == fast_str and
+    open(out_dir + "/slow", "rb").read() == slow_str
+  )
+
+
+def transfer(server_flags=[], client_flags=[], server_reference=False,
+             client_reference=False):
+  """
+  Sends a lot of data from a client to a server, either of which may be the
+  reference. Checks that the server outputs all of it, unchanged.
+
+  server_flags: Flags for the server.
+  client_flags: Flags for the client.
+  server_reference: Whether or not to use the reference binary for the server.
+  client_reference: Whether or not to use the reference binary for the client.
+  """
+  test_str = os.urandom(200000)
+  client_port, server_port = choose_ports()
+  server = start_server(port=server_port, flags=server_flags,
+                        reference=server_reference, debug=False)
+  time.sleep(0.5)
+  client = start_client(server_port=server_port, port=client_port,
+                        flags=client_flags, reference=client_reference,
+                        debug=False)
+
+  write_all_to(client, test_str)
+  return read_all_from(server, len(test_str), 4 * TEST_TIMEOUT) == test_str
+
+
+def options_unreliability(flag):
+  """
+  Sends a lot of data unreliably in both directions, with SACK and timestamps
+  on at both ends.
+  """
+  flags = ["--sack", "--timestamps", flag, "5"]
+  return transfer(server_flags=flags, client_flags=flags)
+
+def options_corruption():
+  return options_unreliability("--corrupt")
+
+def options_drops():
+  return options_unreliability("--drop")
+
+def options_delays():
+  return options_unreliability("--delay")
+
+
+def options_one_side():
+  """
+  Only one side offers SACK or timestamps, so neither side may use them. Then
+  the student/client offers both to the reference/server, which knows
+  neither.
+  """
+  for option in ["--sack", "--timestamps"]:
+    if not transfer(server_flags=[option, "--drop", "5"],
+                    client_flags=["--drop", "5"]):
+      return False
+    if not transfer(server_flags=["--drop", "5"],
+                    client_flags=[option, "--drop", "5"]):
+      return False
+
+  return transfer(client_flags=["--sack", "--timestamps"],
+                  server_reference=True)
+
+
+def unscaled_window():
+  """
+  The reference does not scale windows, so the student's side of the
+  connection must keep its window within 16 bits even when asked for a
+  larger one. Data goes both to and from a student with a large window.
+  """
+  return (
+    transfer(server_flags=["-w", "256"], client_reference=True) and
+    transfer(client_flags=["-w", "256"], server_reference=True)
+  )
+
+
 # Tests to run.
 TESTS = [
   # Test type, test name, test function
@@ -677,6 +862,31 @@ TESTS = [
   ("advanced", "Tears down connection", connection_teardown,
    "Puts an EOF in client 1's and client 2's STDINs. Checks that connection\n" +
    "teardown happens on both sides (calls to ctcp_destroy())."),
+  ("advanced", "Serves others while a program stalls", program_stall,
+   "Client 1's program on the server stops reading while client 1 sends a\n" +
+   "lot of data. Checks that client 2's data still reaches its program\n" +
+   "right away, and that both programs get all of their data."),
+  ("advanced", "Handles corruption with SACK and timestamps",
+   options_corruption,
+   "Corrupts segments in both directions while client 1 sends a lot of\n" +
+   "data, with SACK and timestamps on. Checks that client 2 outputs all of\n" +
+   "it, unchanged."),
+  ("advanced", "Handles drops with SACK and timestamps", options_drops,
+   "Drops segments in both directions while client 1 sends a lot of data,\n" +
+   "with SACK and timestamps on. Checks that client 2 outputs all of it,\n" +
+   "unchanged."),
+  ("advanced", "Handles delay with SACK and timestamps", options_delays,
+   "Delays segments in both directions while client 1 sends a lot of data,\n" +
+   "with SACK and timestamps on. Checks that client 2 outputs all of it,\n" +
+   "unchanged."),
+  ("advanced", "Handles options only one side offers", options_one_side,
+   "Only one of the clients turns on SACK or timestamps, and drops\n" +
+   "segments. Then client 1 turns both on with the reference as client 2.\n" +
+   "Checks that client 2 outputs all of the data each time."),
+  ("advanced", "Handles a peer that does not scale windows", unscaled_window,
+   "Client 1 asks for a window larger than 16 bits can hold. Client 2 is\n" +
+   "the reference, which does not scale windows. Sends a lot of data each\n" +
+   "way and checks that all of it is output."),
 
   # Tests for only Lab 2.
   ("advanced", "Handles sliding window", larger_windows,